@@ -6,7 +6,10 @@
 #ifndef EVM_H
 #define EVM_H
 
-#define EVM_NUMREGS 4
+#include <stdio.h>
+
+#define EVM_NUMREGS 4  // registers r1, r2, ... of an image that doesn't declare how many it uses
+#define EVM_MAXREGS 32
 #define EVM_MAGIC (((int)'E')<<16 | ((int)'V')<<8 | ((int)'M'))
 
 typedef union {
@@ -19,7 +22,7 @@ typedef struct {
 	int ip;
 	union{
 		int sp;
-		evm_word r[EVM_NUMREGS+1]; // first reg is stack pointer
+		evm_word r[EVM_MAXREGS+1]; // first reg is stack pointer
 	};
 } evm_regs;
 
@@ -31,15 +34,117 @@ typedef struct {
 	evm_word mem[];
 } evm_mem;
 
-typedef evm_regs (*evm_syscall_callback) (evm_regs, evm_mem *);
+// version flag of a snapshot: the registers to resume from follow the code segment
+#define EVM_SNAPSHOT 0x100
+
+// version bits 16-23: the number of registers that the image uses (0: EVM_NUMREGS)
+#define EVM_REGS_SHIFT 16
+#define EVM_REGS_MASK  0xff
+
+/*
+	The context of a running program, passed to native functions (syscalls).
+	The host fills in `user` and the table of natives, indexed by syscall code
+	(r1). The interpreter sets the other fields: a native function can read and
+	change the registers and the memory of the program, and returns an error
+	message (which stops the program) or 0. `r` points at the interpreter's own
+	registers, so a syscall doesn't copy them; it is only valid during the call.
+*/
+typedef struct evm_vm evm_vm;
+typedef const char *(*evm_native) (evm_vm *vm);
+
+// memory past the image that a program may use, words [start, end) (see evm_vm)
+typedef struct {
+	int start, end;
+} evm_heap;
+
+struct evm_vm {
+	evm_regs *r;
+	evm_mem *memory;
+	int start_data, end_data;
+	int start_code, end_code;
+
+	void *user;
+	const evm_native *natives;
+	int nnatives;
+	FILE *out; // where put and fput print (stdout if 0)
+
+	// set by a native function that can't complete without blocking: evm_run
+	// returns with the wait flag in its status, and the host resumes the
+	// program (from the returned registers) when it has stored the result
+	int wait;
+
+	// words of the memory buffer past the image that the program may also
+	// access, e.g. a heap that the host's natives allocate from; they must be
+	// below end_memory, which evm_run sets to the number of words that fit in
+	// the buffer. Natives may move heap->end while the program runs.
+	evm_heap *heap;
+	int end_memory;
+};
 
 typedef struct {
 	const char *errmsg;
 	evm_regs r;
 	int stop;
+	int wait;            // stopped in a syscall that the host must complete (see evm_vm)
+	int trap;            // stopped at a trap instruction (a debugger's breakpoint), ip at the trap
+	long long retired;   // instructions executed by this call
+	long long syscalls;  // syscall instructions executed
+	long long out_bytes; // bytes printed by put and fput
+	int nregs;           // registers of the program (r1 .. r[nregs])
 } evm_status;
 
-evm_status evm_run (int mem_bufsz, evm_mem *memory, evm_syscall_callback syscall, evm_regs *initial_state, int single_step);
+/*
+	Flags for evm_run_ex. Each combination selects a separately compiled
+	variant of the interpreter loop, so features that are switched off cost
+	nothing at run time.
+*/
+enum {
+	EVM_UNCHECKED = 1, // skip register, address and segment checks (only for trusted images)
+	EVM_STEP      = 2, // execute a single instruction and return
+	EVM_HOOKED    = 4, // use the hooks (counters, callbacks, limit)
+	EVM_PUBLISH   = 8, // store the ip in hooks->ip_out before every instruction (for signal handlers)
+};
+
+#ifdef EVM_UNSAFE
+#define EVM_DEFAULT_FLAGS EVM_UNCHECKED
+#else
+#define EVM_DEFAULT_FLAGS 0
+#endif
+
+typedef struct {
+	void *ctx;
+	// called before each instruction; returning nonzero stops execution before it
+	int (*insn)(void *ctx, const evm_regs *r, evm_mem *memory);
+	// optional counters indexed by (ip - start of code segment): how often each 
+	// instruction was executed, and how often each jump was taken
+	unsigned long long *counts;
+	unsigned long long *taken;
+	// called before each write to memory (st, std, push, cas, xadd, ast) with its
+	// address, e.g. to log the old value of the word
+	void (*store)(void *ctx, int addr, evm_mem *memory);
+	// stop after executing this many instructions (0: no limit)
+	long long limit;
+	// with EVM_PUBLISH, the address of the instruction being executed
+	volatile int *ip_out;
+} evm_hooks;
+
+evm_status evm_run (int mem_bufsz, evm_mem *memory, evm_vm *vm, evm_regs *initial_state, int single_step);
+evm_status evm_run_ex (int mem_bufsz, evm_mem *memory, evm_vm *vm, evm_regs *initial_state, int flags, const evm_hooks *hooks);
+
+/*
+	Batched execution: runs `lanes` instances of one program in lockstep, each
+	with its own data segment and registers. The host fills in the data
+	segments (interleaved, so that the lanes' copies of a word are next to each
+	other) and gets back the result of each lane. syscalls are not supported.
+*/
+typedef struct {
+	int lanes;
+	evm_word *data;     // word i of lane l is data[i*lanes + l]
+	FILE **out;         // where each lane's put and fput print (all to stdout if 0)
+	evm_status *status; // the result of each lane
+} evm_batch;
+
+const char *evm_run_batch (int mem_bufsz, evm_mem *memory, evm_batch *batch);
 
 typedef enum {
 	OP_STOP   = 0x00,
@@ -78,8 +183,13 @@ typedef enum {
 	OP_LDA    = 0x21,
 	OP_LDD    = 0x22,
 	OP_STD    = 0x23,
+	OP_CAS    = 0x24,
+	OP_XADD   = 0x25,
+	OP_ALD    = 0x26,
+	OP_AST    = 0x27,
+	OP_TRAP   = 0x28,
 
-	OP_INVAL  = 0x24,
+	OP_INVAL  = 0x29,
 } evm_op;
 
 typedef enum {
@@ -133,10 +243,17 @@ const evm_op_t evm_ops[] = {
 	[OP_LDA]     = {OP_LDA,  "lda",  2, {EVM_REG, EVM_MEM}},
 	[OP_LDD]     = {OP_LDD,  "ldd",  2, {EVM_REG, EVM_REG}},
 	[OP_STD]     = {OP_STD,  "std",  2, {EVM_REG, EVM_REG}},
+	[OP_CAS]     = {OP_CAS,  "cas",  2, {EVM_REG, EVM_REG}},
+	[OP_XADD]    = {OP_XADD, "xadd", 2, {EVM_REG, EVM_REG}},
+	[OP_ALD]     = {OP_ALD,  "ald",  2, {EVM_REG, EVM_REG}},
+	[OP_AST]     = {OP_AST,  "ast",  2, {EVM_REG, EVM_REG}},
+	[OP_TRAP]    = {OP_TRAP, "trap", 0},
 };
 
 
 const char * validate_evm_mem(int mem_bufsz, evm_mem *memory);
+evm_regs * evm_snapshot_regs(int mem_bufsz, evm_mem *memory);
+int evm_numregs(const evm_mem *memory);
 
 #endif
 
@@ -144,13 +261,16 @@ const char * validate_evm_mem(int mem_bufsz, evm_mem *memory);
 #define ssizeof(x) ((long long)sizeof(x))
 
 #include <stdio.h> //TODO remove
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
 
 const char * validate_evm_mem(int mem_bufsz, evm_mem *memory) 
 {
 	if (mem_bufsz < ssizeof(*memory)) 
 		return "invalid memory image: buffer too small";
 
-	if (ssizeof(evm_mem) + memory->len_data + memory->len_code > mem_bufsz) 
+	if (ssizeof(evm_mem) + 4LL*memory->len_data + 4LL*memory->len_code > mem_bufsz) 
 		return "invalid memory image: header indicates memory overflows provided buffer";
 
 	if (memory->len_data < 0 || memory->len_code < 0)
@@ -159,11 +279,53 @@ const char * validate_evm_mem(int mem_bufsz, evm_mem *memory)
 	if (memory->magic != EVM_MAGIC) 
 		return "invalid memory image: wrong magic number";
 
+	if (evm_numregs(memory) > EVM_MAXREGS) 
+		return "invalid memory image: too many registers";
+
 	return 0;
 }
 
-evm_status evm_run(int mem_bufsz, evm_mem *memory, evm_syscall_callback syscall, evm_regs *initial_state, int single_step)
+int evm_numregs(const evm_mem *memory)
+{
+	int n = (memory->version >> EVM_REGS_SHIFT) & EVM_REGS_MASK;
+	return n ? n : EVM_NUMREGS;
+}
+
+// the registers saved in a snapshot image (to pass to evm_run), or 0 if it isn't one
+evm_regs * evm_snapshot_regs(int mem_bufsz, evm_mem *memory)
+{
+	if (validate_evm_mem(mem_bufsz, memory) || !(memory->version & EVM_SNAPSHOT)) return 0;
+
+	long long end = 4LL*(memory->len_data + memory->len_code);
+	if (ssizeof(evm_mem) + end + ssizeof(evm_regs) > mem_bufsz) return 0;
+	return (evm_regs*)((char*)memory->mem + end);
+}
+
+#if defined(__GNUC__)
+#define EVM_INLINE static inline __attribute__((always_inline))
+#else
+#define EVM_INLINE static inline
+#endif
+
+// the slow path of the memory check, for addresses outside the data segment
+static int evm__in_heap(const evm_vm *vm, int x)
 {
+	const evm_heap *h = vm ? vm->heap : 0;
+	return h && x >= h->start && x < __atomic_load_n(&h->end, __ATOMIC_RELAXED);
+}
+
+/*
+	The one definition of the interpreter loop. `flags` is always a compile
+	time constant here (see EVM_VARIANT below), so the compiler removes the
+	code for every feature that the variant doesn't use.
+*/
+EVM_INLINE evm_status evm__run(int mem_bufsz, evm_mem *memory, evm_vm *vm, evm_regs *initial_state, const evm_hooks *hooks, const int flags)
+{
+	const int checked  = !(flags & EVM_UNCHECKED);
+	const int stepping = flags & EVM_STEP;
+	const int hooked   = flags & EVM_HOOKED;
+	const int publish  = flags & EVM_PUBLISH;
+
 	const char *val_err = validate_evm_mem(mem_bufsz, memory);  
 	if(val_err) return (evm_status){.errmsg = val_err};
 
@@ -171,56 +333,92 @@ evm_status evm_run(int mem_bufsz, evm_mem *memory, evm_syscall_callback syscall,
 	int end_data   = memory->len_data;
 	int start_code = end_data;
 	int end_code   = start_code + memory->len_code;
+	const int nregs = evm_numregs(memory);
 
 	evm_word *mem = memory->mem;
 
 	evm_regs r = {.ip = start_code, .sp = end_data-1};
 	if (initial_state) r = *initial_state;
 
-	#ifdef EVM_UNSAFE
-	#define CHKREG(x) 
-	#define CHKMEM(x) 
-	#define CHKCOD(x) 
-	#else
-	#define CHKREG(x) if(x < 0 || x > EVM_NUMREGS) return (evm_status){.errmsg="encountered invalid register", .r=r};
-	#define CHKMEM(x) if(x < start_data || x >= end_data) return (evm_status){.errmsg="encountered invalid memory address", .r=r};
-	#define CHKCOD(x) if(x < start_code || x >= end_code) return (evm_status){.errmsg="encountered invalid code address", .r=r};
-	#endif
+	if (vm) {
+		vm->r = &r;
+		vm->memory = memory;
+		vm->start_data = start_data;
+		vm->end_data = end_data;
+		vm->start_code = start_code;
+		vm->end_code = end_code;
+		vm->end_memory = (int)((mem_bufsz - (long long)sizeof(evm_mem)) / (long long)sizeof(evm_word));
+	}
+
+	long long retired = 0, syscalls = 0, out_bytes = 0;
+	FILE *out = vm && vm->out ? vm->out : stdout;
+
+	int (*insn_hook)(void *, const evm_regs *, evm_mem *) = hooked && hooks ? hooks->insn : 0;
+	unsigned long long *counts = hooked && hooks ? hooks->counts : 0;
+	unsigned long long *taken  = hooked && hooks ? hooks->taken : 0;
+	void (*store_hook)(void *, int, evm_mem *) = hooked && hooks ? hooks->store : 0;
+	const long long limit = hooked && hooks ? hooks->limit : 0;
+	volatile int *ip_out = publish ? hooks->ip_out : 0;
+
+	#define EVM_RETURN(...) do { evm_status s_ = {__VA_ARGS__}; s_.retired = retired; s_.syscalls = syscalls; s_.out_bytes = out_bytes; s_.nregs = nregs; return s_; } while (0)
+	#define CHKREG(x) if(checked && (x < 0 || x > nregs)) EVM_RETURN(.errmsg="encountered invalid register", .r=r);
+	#define CHKMEM(x) if(checked && (x < start_data || x >= end_data) && !evm__in_heap(vm, x)) EVM_RETURN(.errmsg="encountered invalid memory address", .r=r);
+	#define CHKCOD(x) if(checked && (x < start_code || x >= end_code)) EVM_RETURN(.errmsg="encountered invalid code address", .r=r);
+	#define TAKEN() if(hooked && taken) taken[r.ip - start_code]++;
+	#define STORE(x) if(hooked && store_hook) store_hook(hooks->ctx, x, memory);
 
 	do {
-		#ifndef EVM_UNSAFE
-		if (r.ip < start_code || r.ip >= end_code) 
-			return (evm_status) {
+		if (checked && (r.ip < start_code || r.ip >= end_code)) 
+			EVM_RETURN(
 				.errmsg = "instruction pointer out of code segment",
-				.r = r,
-			};
-		if (r.sp < start_data || r.sp >= end_data) 
-			return (evm_status) {
+				.r = r
+			);
+		if (checked && (r.sp < start_data || r.sp >= end_data)) 
+			EVM_RETURN(
 				.errmsg = "stack pointer out of data segment",
-				.r = r,
-			};
-		#endif
+				.r = r
+			);
+
+		if (publish) 
+			*ip_out = r.ip;
+		if (hooked && limit && retired == limit)
+			break;
+		if (hooked && insn_hook && insn_hook(hooks->ctx, &r, memory))
+			break;
+		if (hooked && counts) 
+			counts[r.ip - start_code]++;
 
 		int op   = mem[r.ip].i;
+		retired++;
 
 		int arg1    = mem[r.ip+1].i;
-		float arg1f = mem[r.ip+1].f;
 
 		int arg2    = mem[r.ip+2].i;
 		float arg2f = mem[r.ip+2].f;
 
 		switch (op) {
 		case OP_STOP:
-			return (evm_status) {.r=r, .stop=1};
+			EVM_RETURN(.r=r, .stop=1);
 		case OP_NOP: 
 			break;
-		case OP_SYSCALL:
-			if(!syscall) return (evm_status) {
-				.errmsg = "encountered syscall instruction, but no syscall callback provided",
-				.r = r,
-			};
-			r = syscall(r, memory);
+		case OP_TRAP:
+			EVM_RETURN(.errmsg = "encountered trap instruction", .r = r, .trap = 1);
+		case OP_SYSCALL: {
+			int code = r.r[1].i;
+			if(!vm || code < 0 || code >= vm->nnatives || !vm->natives[code]) EVM_RETURN(
+				.errmsg = "encountered syscall instruction, but no native function for its code",
+				.r = r
+			);
+			syscalls++;
+			vm->wait = 0;
+			const char *err = vm->natives[code](vm);
+			if(err) EVM_RETURN(.errmsg = err, .r = r);
+			if(vm->wait) {
+				r.ip += 1;
+				EVM_RETURN(.r = r, .wait = 1);
+			}
 			break;
+		}
 		case OP_LD:
 			CHKREG(arg1);
 			CHKMEM(arg2);
@@ -229,6 +427,7 @@ evm_status evm_run(int mem_bufsz, evm_mem *memory, evm_syscall_callback syscall,
 		case OP_ST:
 			CHKMEM(arg1);
 			CHKREG(arg2);
+			STORE(arg1);
 			mem[arg1].i = r.r[arg2].i;
 			break;
 		case OP_SET:
@@ -246,6 +445,7 @@ evm_status evm_run(int mem_bufsz, evm_mem *memory, evm_syscall_callback syscall,
 			break;
 		case OP_PUSH:
 			CHKREG(arg1);
+			STORE(r.sp);
 			mem[r.sp-- ].i = r.r[arg1].i;
 			break;
 		case OP_POP:
@@ -319,6 +519,7 @@ evm_status evm_run(int mem_bufsz, evm_mem *memory, evm_syscall_callback syscall,
 			CHKREG(arg1);
 			CHKCOD(arg2);
 			if(r.r[arg1].i > 0) {
+				TAKEN();
 				r.ip = arg2;
 				continue;
 			}
@@ -327,6 +528,7 @@ evm_status evm_run(int mem_bufsz, evm_mem *memory, evm_syscall_callback syscall,
 			CHKREG(arg1);
 			CHKCOD(arg2);
 			if(r.r[arg1].i >= 0) {
+				TAKEN();
 				r.ip = arg2;
 				continue;
 			}
@@ -335,6 +537,7 @@ evm_status evm_run(int mem_bufsz, evm_mem *memory, evm_syscall_callback syscall,
 			CHKREG(arg1);
 			CHKCOD(arg2);
 			if(r.r[arg1].i == 0) {
+				TAKEN();
 				r.ip = arg2;
 				continue;
 			}
@@ -343,6 +546,7 @@ evm_status evm_run(int mem_bufsz, evm_mem *memory, evm_syscall_callback syscall,
 			CHKREG(arg1);
 			CHKCOD(arg2);
 			if(r.r[arg1].i < 0) {
+				TAKEN();
 				r.ip = arg2;
 				continue;
 			}
@@ -351,12 +555,14 @@ evm_status evm_run(int mem_bufsz, evm_mem *memory, evm_syscall_callback syscall,
 			CHKREG(arg1);
 			CHKCOD(arg2);
 			if(r.r[arg1].i <= 0) {
+				TAKEN();
 				r.ip = arg2;
 				continue;
 			}
 			break;
 		case OP_J:
 			CHKCOD(arg1);
+			TAKEN();
 			r.ip = arg1;
 			continue;
 		case OP_CVTFI:
@@ -369,11 +575,11 @@ evm_status evm_run(int mem_bufsz, evm_mem *memory, evm_syscall_callback syscall,
 			break;
 		case OP_PUT:
 			CHKREG(arg1);
-			printf("%i\n", r.r[arg1].i);
+			out_bytes += fprintf(out, "%i\n", r.r[arg1].i);
 			break;
 		case OP_FPUT:
 			CHKREG(arg1);
-			printf("%f\n", r.r[arg1].f);
+			out_bytes += fprintf(out, "%f\n", r.r[arg1].f);
 			break;
 		case OP_LDA:
 			CHKREG(arg1);
@@ -390,20 +596,343 @@ evm_status evm_run(int mem_bufsz, evm_mem *memory, evm_syscall_callback syscall,
 			CHKREG(arg1);
 			CHKREG(arg2);
 			CHKMEM(r.r[arg1].i);
+			STORE(r.r[arg1].i);
 			mem[r.r[arg1].i].i = r.r[arg2].i;
 			break;
+
+		/*
+			Atomic instructions, for programs whose threads share the data
+			segment (see the spawn syscall in main.c). cas and xadd are
+			sequentially consistent, ald is an acquire load and ast a release
+			store.
+		*/
+		case OP_CAS:
+			// if the word at the address in arg1 equals r1, replace it with arg2; r1 = the old word
+			CHKREG(arg1);
+			CHKREG(arg2);
+			CHKMEM(r.r[arg1].i);
+			STORE(r.r[arg1].i);
+			__atomic_compare_exchange_n(&mem[r.r[arg1].i].i, &r.r[1].i, r.r[arg2].i, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+			break;
+		case OP_XADD:
+			// add arg2 to the word at the address in arg1; arg2 = the old word
+			CHKREG(arg1);
+			CHKREG(arg2);
+			CHKMEM(r.r[arg1].i);
+			STORE(r.r[arg1].i);
+			r.r[arg2].i = __atomic_fetch_add(&mem[r.r[arg1].i].i, r.r[arg2].i, __ATOMIC_SEQ_CST);
+			break;
+		case OP_ALD:
+			CHKREG(arg1);
+			CHKREG(arg2);
+			CHKMEM(r.r[arg2].i);
+			r.r[arg1].i = __atomic_load_n(&mem[r.r[arg2].i].i, __ATOMIC_ACQUIRE);
+			break;
+		case OP_AST:
+			CHKREG(arg1);
+			CHKREG(arg2);
+			CHKMEM(r.r[arg1].i);
+			STORE(r.r[arg1].i);
+			__atomic_store_n(&mem[r.r[arg1].i].i, r.r[arg2].i, __ATOMIC_RELEASE);
+			break;
 		default: 
-			return (evm_status) {
+			EVM_RETURN(
 				.errmsg = "encountered unrecognized instruction",
-				.r = r,
-			};
+				.r = r
+			);
 		}
 
 		r.ip += 1 + evm_ops[op].nargs;
 
-	} while (!single_step);
+	} while (!stepping);
 
-	return (evm_status) {.r=r};
+	EVM_RETURN(.r=r);
+
+	#undef EVM_RETURN
+	#undef CHKREG
+	#undef CHKMEM
+	#undef CHKCOD
+	#undef TAKEN
+	#undef STORE
+}
+
+#define EVM_VARIANT(n) \
+	static evm_status evm__run_##n(int mem_bufsz, evm_mem *memory, evm_vm *vm, evm_regs *initial_state, const evm_hooks *hooks) \
+	{ return evm__run(mem_bufsz, memory, vm, initial_state, hooks, n); }
+
+EVM_VARIANT(0)  EVM_VARIANT(1)  EVM_VARIANT(2)  EVM_VARIANT(3)
+EVM_VARIANT(4)  EVM_VARIANT(5)  EVM_VARIANT(6)  EVM_VARIANT(7)
+EVM_VARIANT(8)  EVM_VARIANT(9)  EVM_VARIANT(10) EVM_VARIANT(11)
+EVM_VARIANT(12) EVM_VARIANT(13) EVM_VARIANT(14) EVM_VARIANT(15)
+
+evm_status evm_run_ex(int mem_bufsz, evm_mem *memory, evm_vm *vm, evm_regs *initial_state, int flags, const evm_hooks *hooks)
+{
+	static evm_status (*const variants[])(int, evm_mem *, evm_vm *, evm_regs *, const evm_hooks *) = {
+		evm__run_0, evm__run_1, evm__run_2, evm__run_3,
+		evm__run_4, evm__run_5, evm__run_6, evm__run_7,
+		evm__run_8, evm__run_9, evm__run_10, evm__run_11,
+		evm__run_12, evm__run_13, evm__run_14, evm__run_15,
+	};
+	if ((flags & EVM_PUBLISH) && !(hooks && hooks->ip_out)) flags &= ~EVM_PUBLISH;
+	return variants[flags & 15](mem_bufsz, memory, vm, initial_state, hooks);
+}
+
+evm_status evm_run(int mem_bufsz, evm_mem *memory, evm_vm *vm, evm_regs *initial_state, int single_step)
+{
+	return evm_run_ex(mem_bufsz, memory, vm, initial_state, EVM_DEFAULT_FLAGS | (single_step ? EVM_STEP : 0), 0);
+}
+
+/*
+	The registers of all lanes are kept as a structure of arrays (register k of
+	every lane is contiguous), so each instruction becomes a loop over the
+	lanes that the compiler can vectorize. Only the lanes whose ip is the
+	lowest run (the others are masked off): when lanes take different branches,
+	they meet again where the paths join, e.g. after an if/else or a loop.
+	While lanes are masked off, the loops only visit the list of active lanes.
+	Lanes that are masked off keep their ip in `ip`; the active lanes are all
+	at `pc`.
+*/
+const char *evm_run_batch(int mem_bufsz, evm_mem *memory, evm_batch *b)
+{
+	const char *err = validate_evm_mem(mem_bufsz, memory);
+	if(err) return err;
+
+	const int n = b->lanes;
+	const int end_data   = memory->len_data;
+	const int start_code = end_data;
+	const int end_code   = start_code + memory->len_code;
+	const evm_word *code = memory->mem;
+	const int nregs = evm_numregs(memory);
+	evm_word *data = b->data;
+
+	evm_word *regs = calloc((size_t)(nregs+1) * n, sizeof(evm_word));
+	int *ip   = malloc((size_t)n * sizeof(int));
+	int *live = malloc((size_t)n * sizeof(int)); // lanes that haven't stopped
+	int *act  = malloc((size_t)n * sizeof(int)); // lanes at pc
+	unsigned char *on = calloc(n, 1);
+	if (!regs || !ip || !live || !act || !on) {
+		free(regs); free(ip); free(live); free(act); free(on);
+		return "out of memory";
+	}
+
+	#define R(k) (regs + (size_t)(k)*n)
+	#define D(addr, l) data[(size_t)(addr)*n + (l)]
+	#define LANES(stmt) do { \
+		if (all) for (int l = 0; l < n; l++) { stmt; } \
+		else for (int i_ = 0; i_ < nact; i_++) { int l = act[i_]; if (on[l]) { stmt; } } \
+	} while (0)
+	#define LANE_STOP(l, msg, stopped) do { \
+		evm_status *s_ = &b->status[l]; \
+		s_->errmsg = msg; \
+		s_->stop = stopped; \
+		s_->retired += executed - since; \
+		s_->r.ip = pc; \
+		s_->nregs = nregs; \
+		for (int k = 0; k <= nregs; k++) s_->r.r[k] = R(k)[l]; \
+		on[l] = 0; \
+		ip[l] = INT_MAX; \
+		active--; \
+		all = 0; \
+	} while (0)
+	#define FAIL_ALL(msg) do { \
+		for (int i_ = 0; i_ < nact; i_++) if (on[act[i_]]) LANE_STOP(act[i_], msg, 0); \
+	} while (0)
+	#define CHKLANES(addr, msg) \
+		for (int i_ = 0; i_ < nact; i_++) { \
+			int l = act[i_]; \
+			if (on[l] && ((addr) < 0 || (addr) >= end_data)) LANE_STOP(l, msg, 0); \
+		} \
+		if (!active) continue;
+
+	for (int l = 0; l < n; l++) {
+		ip[l] = start_code;
+		live[l] = l;
+		R(0)[l].i = end_data - 1;
+		b->status[l] = (evm_status){0};
+	}
+
+	int nlive = n, nact = 0, active = 0, all = 0;
+	int pc = start_code, next = INT_MAX; // next: the lowest ip of the lanes that are masked off
+	long long executed = 0, since = 0;
+
+	for (;;) {
+		if (!active || pc >= next) {
+			// forget the lanes that stopped, and pick the ones with the lowest ip
+			int lo = INT_MAX, k = 0;
+			for (int i = 0; i < nlive; i++) {
+				int l = live[i];
+				if (on[l]) {
+					ip[l] = pc;
+					b->status[l].retired += executed - since;
+				}
+				if (ip[l] == INT_MAX) continue;
+				live[k++] = l;
+				if (ip[l] < lo) lo = ip[l];
+			}
+			nlive = k;
+			if (!nlive) break;
+
+			since = executed;
+			nact = 0;
+			next = INT_MAX;
+			for (int i = 0; i < nlive; i++) {
+				int l = live[i];
+				on[l] = ip[l] == lo;
+				if (on[l]) act[nact++] = l;
+				else if (ip[l] < next) next = ip[l];
+			}
+			active = nact;
+			pc = lo;
+			all = active == n;
+		}
+
+		executed++;
+		if (pc < start_code || pc >= end_code) {
+			FAIL_ALL("instruction pointer out of code segment");
+			continue;
+		}
+
+		int op = code[pc].i;
+		int arg1 = code[pc+1].i;
+		int arg2 = code[pc+2].i;
+		float arg2f = code[pc+2].f;
+
+		if (op < 0 || op >= OP_INVAL) {
+			FAIL_ALL("encountered unrecognized instruction");
+			continue;
+		}
+
+		// the arguments are the same for all lanes
+		int bad = 0;
+		for (int k = 0; k < evm_ops[op].nargs && !bad; k++) {
+			int a = k ? arg2 : arg1;
+			if (evm_ops[op].argtypes[k] == EVM_REG && (a < 0 || a > nregs)) {
+				FAIL_ALL("encountered invalid register");
+				bad = 1;
+			} else if (evm_ops[op].argtypes[k] == EVM_MEM && op >= OP_JP && op <= OP_J) {
+				if (a < start_code || a >= end_code) {
+					FAIL_ALL("encountered invalid code address");
+					bad = 1;
+				}
+			} else if (evm_ops[op].argtypes[k] == EVM_MEM && (a < 0 || a >= end_data)) {
+				FAIL_ALL("encountered invalid memory address");
+				bad = 1;
+			}
+		}
+		if (bad) continue;
+
+		evm_word *x  = R(evm_ops[op].argtypes[0] == EVM_REG ? arg1 : 0);
+		evm_word *y  = R(evm_ops[op].argtypes[1] == EVM_REG ? arg2 : 0);
+		evm_word *sp = R(0);
+		evm_word *r1 = R(1);
+
+		switch (op) {
+		case OP_STOP:
+			for (int i = 0; i < nact; i++) if (on[act[i]]) LANE_STOP(act[i], 0, 1);
+			continue;
+		case OP_NOP:
+			break;
+		case OP_SYSCALL:
+			FAIL_ALL("syscalls are not supported in batched execution");
+			continue;
+		case OP_TRAP:
+			FAIL_ALL("encountered trap instruction");
+			continue;
+		case OP_LD:   LANES(x[l] = D(arg2, l)); break;
+		case OP_ST:   LANES(D(arg1, l) = y[l]); break;
+		case OP_SET:  LANES(x[l].i = arg2); break;
+		case OP_FSET: LANES(x[l].f = arg2f); break;
+		case OP_LDA:  LANES(x[l].i = arg2); break;
+		case OP_CPY:  LANES(x[l] = y[l]); break;
+		case OP_PUSH:
+			CHKLANES(sp[l].i, "stack pointer out of data segment");
+			LANES(D(sp[l].i, l) = x[l]; sp[l].i--);
+			break;
+		case OP_POP:
+			CHKLANES(sp[l].i + 1, "stack pointer out of data segment");
+			LANES(sp[l].i++; x[l] = D(sp[l].i, l));
+			break;
+		case OP_ADD:  LANES(x[l].u += y[l].u); break;
+		case OP_SUB:  LANES(x[l].u -= y[l].u); break;
+		case OP_MUL:  LANES(x[l].u *= y[l].u); break;
+		case OP_DIV:  LANES(x[l].i /= y[l].i); break;
+		case OP_FADD: LANES(x[l].f += y[l].f); break;
+		case OP_FSUB: LANES(x[l].f -= y[l].f); break;
+		case OP_FMUL: LANES(x[l].f *= y[l].f); break;
+		case OP_FDIV: LANES(x[l].f /= y[l].f); break;
+		case OP_NOT:  LANES(x[l].u = ~x[l].u); break;
+		case OP_LNOT: LANES(x[l].i = !x[l].i); break;
+		case OP_AND:  LANES(x[l].u &= y[l].u); break;
+		case OP_OR:   LANES(x[l].u |= y[l].u); break;
+		case OP_XOR:  LANES(x[l].u ^= y[l].u); break;
+		case OP_CVTFI: LANES(x[l].i = x[l].f); break;
+		case OP_CVTIF: LANES(x[l].f = x[l].i); break;
+		case OP_PUT:
+			LANES(b->status[l].out_bytes += fprintf(b->out ? b->out[l] : stdout, "%i\n", x[l].i));
+			break;
+		case OP_FPUT:
+			LANES(b->status[l].out_bytes += fprintf(b->out ? b->out[l] : stdout, "%f\n", x[l].f));
+			break;
+		case OP_LDD:
+		case OP_ALD: // lanes don't share memory, so atomics are ordinary accesses
+			CHKLANES(y[l].i, "encountered invalid memory address");
+			LANES(x[l] = D(y[l].i, l));
+			break;
+		case OP_STD:
+		case OP_AST:
+			CHKLANES(x[l].i, "encountered invalid memory address");
+			LANES(D(x[l].i, l) = y[l]);
+			break;
+		case OP_CAS:
+			CHKLANES(x[l].i, "encountered invalid memory address");
+			LANES(evm_word old = D(x[l].i, l); if (old.i == r1[l].i) D(x[l].i, l) = y[l]; r1[l] = old);
+			break;
+		case OP_XADD:
+			CHKLANES(x[l].i, "encountered invalid memory address");
+			LANES(evm_word old = D(x[l].i, l); D(x[l].i, l).u += y[l].u; y[l] = old);
+			break;
+		case OP_J:
+			pc = arg1;
+			continue;
+		case OP_JP: case OP_JPZ: case OP_JZ: case OP_JN: case OP_JNZ: {
+			#define COND(v) (op == OP_JP ? (v) > 0 : op == OP_JPZ ? (v) >= 0 : op == OP_JZ ? (v) == 0 : op == OP_JN ? (v) < 0 : (v) <= 0)
+			int taken = 0;
+			LANES(taken += COND(x[l].i));
+
+			if (taken == active) {
+				pc = arg2;
+			} else if (taken == 0) {
+				pc += 3;
+			} else {
+				// the lanes diverge
+				LANES(ip[l] = COND(x[l].i) ? arg2 : pc + 3; b->status[l].retired += executed - since; on[l] = 0);
+				since = executed;
+				active = 0;
+			}
+			#undef COND
+			continue;
+		}
+		default:
+			FAIL_ALL("encountered unrecognized instruction");
+			continue;
+		}
+
+		pc += 1 + evm_ops[op].nargs;
+	}
+
+	#undef R
+	#undef D
+	#undef LANES
+	#undef LANE_STOP
+	#undef FAIL_ALL
+	#undef CHKLANES
+
+	free(regs);
+	free(ip);
+	free(live);
+	free(act);
+	free(on);
+	return 0;
 }
 
 #endif
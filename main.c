@@ -3,6 +3,7 @@
 	This is free and unencumbered software released into the public domain.
 */
 
+#define _GNU_SOURCE
 #define EVM_IMPLEMENTATION
 #include "evm.h"
 
@@ -11,8 +12,33 @@
 #include <string.h>
 #include <assert.h>
 #include <stdarg.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <setjmp.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <ucontext.h>
+#endif
 
 
+// largest image (or source file) that can be assembled or executed
+#define MAX_IMAGE_BYTES (32<<20)
+
 typedef enum {
 	TOK_INVALID = 0,
 	TOK_FLOATLIT,
@@ -21,6 +47,7 @@ typedef enum {
 	TOK_ID,
 	TOK_COMMA,
 	TOK_COLON,
+	TOK_OPERATOR,
 	TOK_EOF,
 	TOK_EOL,
 } token_type;
@@ -39,15 +66,134 @@ typedef struct {
 	char *s;
 	int len;
 	int where;
+	int code;
+	int equ;      // an equ constant, see below
 } label;
 
+enum {
+	EQU_VALUE = 1, // where is its value
+	EQU_EXPR,      // where is the position of its expression in the source
+	EQU_BUSY,      // that expression is being evaluated (to catch circular definitions)
+};
+
+// a data word whose value is evaluated once all labels are known
+typedef struct {
+	int where;
+	int pos; // of the expression in the source
+} pending_word;
+
+/*
+	Relocatable object files (-c) and the linker (-l).
+
+	An object file holds a module's data and code segments laid out exactly as
+	they would be in a standalone image (data at address 0, code right after),
+	followed by a symbol table and a list of relocations. Every EVM_MEM operand
+	that refers to a label gets a relocation, so the linker can move the
+	module's segments and patch the addresses.
+*/
+
+#define EVM_OBJ_MAGIC (((int)'E')<<16 | ((int)'V')<<8 | ((int)'O'))
+#define EVM_SYMLEN 32
+
+typedef struct {
+	int magic;
+	int version;
+	int len_data;
+	int len_code;
+	int nsyms;
+	int nrelocs;
+	evm_word mem[]; // followed by nsyms evm_sym, then nrelocs evm_reloc
+} evm_obj;
+
+enum {
+	SYM_EXPORT = 1,
+	SYM_IMPORT = 2,
+	SYM_CODE   = 4,
+};
+
+typedef struct {
+	char name[EVM_SYMLEN];
+	int where;
+	int flags;
+} evm_sym;
+
+enum {
+	RELOC_DATA,   // address of a data label in this module
+	RELOC_CODE,   // address of a code label in this module
+	RELOC_IMPORT, // address of an imported symbol, added to the stored word
+};
+
+typedef struct {
+	int where;
+	int kind;
+	int sym;
+} evm_reloc;
+
+/*
+	Debug info (-g)
+
+	When assembling with `-g file`, the assembler also writes a debug info file
+	for the image: which source line every statement's words came from, and the
+	labels with their addresses and sizes (the distance to the next label in the
+	same segment). Given to the other modes with `-g file`, it is used to show
+	label names and source lines instead of bare addresses. The image itself is
+	unchanged, and nothing reads the file unless asked to. The file records a
+	hash of the image's segment sizes and code, so that it isn't used with
+	another image (e.g. after -O moved the code).
+*/
+
+#define EVM_DEBUG_MAGIC (((int)'E')<<16 | ((int)'V')<<8 | ((int)'G'))
+
+typedef struct {
+	int magic;
+	int nlines;
+	int nlabels;
+	int strsz;    // bytes of names, the source file's first
+	unsigned long long key;
+	// followed by nlines debug_line, nlabels debug_label, then the names
+} evm_debug_hdr;
+
+typedef struct {
+	int where; // the first word of a statement
+	int line;
+} debug_line;
+
+typedef struct {
+	int where;
+	int size; // in words
+	int name; // offset into the names
+	int code;
+} debug_label;
+
 typedef struct {
 	int bufsz;
 	int pos;
 	char *buf;
 	int mempos;
-	label labels[40];
-	int nlabels;
+	int memwords; // size of the image being assembled
+	int in_code;
+	int maxreg;   // the highest register used
+	label *labels;
+	int nlabels, maxlabels;
+	pending_word *pending;
+	int npending, maxpending;
+	int data_end, code_end; // known once the code is laid out (pass 1)
+	int in_zeros; // evaluating the size of a zeros statement, which can't wait for later labels
+
+	// only used when assembling an object file
+	int object;
+	label *exports;
+	int nexports, maxexports;
+	label *imports;
+	int nimports, maximports;
+	evm_reloc *relocs;
+	int nrelocs, maxrelocs;
+
+	// only used when writing debug info
+	int debug;
+	int line, linepos; // the line number at linepos
+	debug_line *lines;
+	int nlines, maxlines;
 } parse_ctx;
 
 void terminal_state(int newstate)
@@ -109,33 +255,70 @@ static _Noreturn void die (parse_ctx *p, char *fmt, ...)
 
 #define ssizeof(x) ((long long)sizeof(x))
 #define COUNT_ARRAY(x) (ssizeof(x)/ssizeof(x[0]))
-void add_label(parse_ctx *p, token t, int where) 
+
+// make room for at least `need` elements in a realloc'd array
+static void *grow(void *arr, int *cap, int need, int elemsz)
+{
+	if (need <= *cap) return arr;
+	int newcap = *cap ? *cap : 64;
+	while (newcap < need) newcap *= 2;
+	arr = realloc(arr, (size_t)newcap * elemsz);
+	if (!arr) die(0, "out of memory");
+	*cap = newcap;
+	return arr;
+}
+
+static unsigned long long fnv1a(unsigned long long h, const void *data, long long len)
+{
+	const unsigned char *x = data;
+	for (long long i = 0; i < len; i++) {
+		h ^= x[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static int find_label(label *labels, int n, token t)
 {
-	if (p->nlabels == COUNT_ARRAY(p->labels))
-	       die (p, "Max label count (%lli) exceeded", COUNT_ARRAY(p->labels));
+	for (int i = 0; i < n; i++) {
+		if(labels[i].len == t.s_len && !memcmp(labels[i].s, t.s, t.s_len)) {
+			return i;
+		}
+	}
+	return -1;
+}
 
+void add_label(parse_ctx *p, token t, int where) 
+{
+	p->labels = grow(p->labels, &p->maxlabels, p->nlabels+1, ssizeof(label));
 	p->labels[p->nlabels++] = (label){
 		.s = t.s,
 		.len = t.s_len,
 		.where = where,
+		.code = p->in_code,
 	};
 }
 
-int lookup(parse_ctx *p, token t)
+void add_export(parse_ctx *p, token t)
 {
-	assert(t.type == TOK_ID);
-
-	for (int i = 0; i < p->nlabels; i++) {
-		if(p->labels[i].len == t.s_len && !memcmp(p->labels[i].s, t.s, t.s_len)) {
-			return p->labels[i].where;
-		}
-	}
+	if (find_label(p->exports, p->nexports, t) >= 0) return;
+	p->exports = grow(p->exports, &p->maxexports, p->nexports+1, ssizeof(label));
+	p->exports[p->nexports++] = (label){.s = t.s, .len = t.s_len};
+}
 
-	char buf[512] = {0};
-	memcpy(buf, t.s, t.s_len < ssizeof(buf)-1 ? t.s_len : ssizeof(buf)-1);
-	die(p, "No such label: %s", buf);
+// record that the word at the current memory position must be patched by the linker
+static void add_reloc(parse_ctx *p, int kind, int sym)
+{
+	p->relocs = grow(p->relocs, &p->maxrelocs, p->nrelocs+1, ssizeof(evm_reloc));
+	p->relocs[p->nrelocs++] = (evm_reloc){.where = p->mempos, .kind = kind, .sym = sym};
 }
 
+// make sure n more words fit into the image
+static void room(parse_ctx *p, long long n)
+{
+	if (p->mempos + n > p->memwords) 
+		die(p, "Program too large (max %i words)", p->memwords);
+}
 
 int try_parse_floatlit(parse_ctx *p, float *val)
 {
@@ -278,6 +461,19 @@ token tok_next(parse_ctx *p)
 		return t;
 	}
 
+	// the operators of expressions, which are parsed separately
+	char ch = p->buf[p->pos];
+	if (ch == '(' || ch == ')' || ch == '*' || ch == '/' || ch == '+' || ch == '-') {
+		t.type = TOK_OPERATOR;
+		p->pos++;
+		return t;
+	}
+	if ((ch == '<' || ch == '>') && p->buf[p->pos+1] == ch) {
+		t.type = TOK_OPERATOR;
+		p->pos += 2;
+		return t;
+	}
+
 	die(p, "Unrecognized token");
 }
 
@@ -294,6 +490,216 @@ int idcmp(token t, const char *str)
 	return !memcmp(str, t.s, l);
 }
 
+/*
+	Constant expressions
+
+	Operands that are addresses or integers, and data words, can be expressions:
+	numbers, labels, `equ` constants and `sizeof(label)` combined with + - * /
+	<< >> and parentheses, evaluated by the assembler. They are parsed from the
+	source text directly rather than from tokens, since e.g. `a-1` would
+	otherwise be a label and a negative number.
+
+	In an object file, a value that depends on a label's address must be that
+	address plus or minus a number (stored in the word, where the linker adds
+	the address of the segment or import to it). The distance between two labels
+	in the same segment doesn't depend on where the linker puts the segment.
+	Pass 1 parses code operands before all labels are known, so it evaluates
+	them with `skip` set: unknown labels are 0, and nothing is checked.
+*/
+
+typedef struct {
+	int value;
+	int reloc; // the relocation that the value needs in an object file, or -1
+	int sym;   // the import, for RELOC_IMPORT
+} expr_value;
+
+// the size of a label in words: up to the next label in its segment
+static int label_size(parse_ctx *p, int i)
+{
+	label *l = &p->labels[i];
+	int end = l->code ? p->code_end : p->data_end;
+	for (int k = 0; k < p->nlabels; k++) {
+		label *n = &p->labels[k];
+		if (!n->equ && n->code == l->code && n->where > l->where && n->where < end) end = n->where;
+	}
+	return end - l->where;
+}
+
+static expr_value expression(parse_ctx *p, int skip, int prec);
+
+static int equ_value(parse_ctx *p, int i)
+{
+	if (p->labels[i].equ == EQU_BUSY) die(p, "Circular definition of %.*s", p->labels[i].len, p->labels[i].s);
+	if (p->labels[i].equ == EQU_EXPR) {
+		p->labels[i].equ = EQU_BUSY;
+		int pos = p->pos;
+		p->pos = p->labels[i].where;
+		expr_value v = expression(p, 0, 0);
+		if (v.reloc >= 0) die(p, "In an object file, an equ constant can't depend on the address of a label");
+		p->pos = pos;
+		p->labels[i].where = v.value;
+		p->labels[i].equ = EQU_VALUE;
+	}
+	return p->labels[i].where;
+}
+
+static expr_value symbol_value(parse_ctx *p, token t, int skip)
+{
+	if (skip) return (expr_value){.reloc = -1};
+	int i = find_label(p->labels, p->nlabels, t);
+	if (i >= 0 && p->labels[i].equ) return (expr_value){.value = equ_value(p, i), .reloc = -1};
+	if (i >= 0) {
+		int reloc = p->object ? (p->labels[i].code ? RELOC_CODE : RELOC_DATA) : -1;
+		return (expr_value){.value = p->labels[i].where, .reloc = reloc};
+	}
+
+	if (p->in_zeros) die(p, "No such label yet: %.*s (an equ must be defined before use in zeros)", t.s_len, t.s);
+	if (p->object) {
+		// undefined labels become imports, resolved by the linker
+		int k = find_label(p->imports, p->nimports, t);
+		if (k < 0) {
+			p->imports = grow(p->imports, &p->maximports, p->nimports+1, ssizeof(label));
+			k = p->nimports++;
+			p->imports[k] = (label){.s = t.s, .len = t.s_len, .where = -1};
+		}
+		return (expr_value){.reloc = RELOC_IMPORT, .sym = k};
+	}
+
+	die(p, "No such label: %.*s", t.s_len, t.s);
+}
+
+static expr_value combine(parse_ctx *p, char op, expr_value x, expr_value y)
+{
+	// label + or - a number stays relocatable, the distance between two labels doesn't need to be
+	if (op == '+' && x.reloc < 0) return (expr_value){(int)((unsigned)x.value + (unsigned)y.value), y.reloc, y.sym};
+	if ((op == '+' || op == '-') && y.reloc < 0) 
+		return (expr_value){(int)(op == '+' ? (unsigned)x.value + (unsigned)y.value : (unsigned)x.value - (unsigned)y.value), x.reloc, x.sym};
+	if (op == '-' && x.reloc == y.reloc && x.reloc != RELOC_IMPORT) 
+		return (expr_value){(int)((unsigned)x.value - (unsigned)y.value), -1, 0};
+	if (x.reloc >= 0 || y.reloc >= 0) 
+		die(p, "In an object file, a label's address can only have a number added to or subtracted from it");
+
+	if (op == '*') x.value = (int)((unsigned)x.value * (unsigned)y.value);
+	if (op == '/') {
+		if (!y.value) die(p, "Division by zero");
+		x.value = y.value == -1 ? (int)(0u - (unsigned)x.value) : x.value / y.value;
+	}
+	if (op == '<' || op == '>') {
+		if (y.value < 0 || y.value > 31) die(p, "Invalid shift: %i", y.value);
+		x.value = op == '<' ? (int)((unsigned)x.value << y.value) : x.value >> y.value;
+	}
+	return x;
+}
+
+// the precedence of the operator at the parse position (0 if there is none)
+static int binary_operator(parse_ctx *p)
+{
+	skipwhitespace(p);
+	char c = p->buf[p->pos], d = p->buf[p->pos+1];
+	if (c == '*' || c == '/') return 3;
+	if (c == '+' || c == '-') return 2;
+	if ((c == '<' || c == '>') && d == c) return 1;
+	return 0;
+}
+
+// parse (and evaluate) operators of higher precedence than prec
+static expr_value expression(parse_ctx *p, int skip, int prec)
+{
+	expr_value x = {.reloc = -1};
+	token t = {.type = TOK_ID};
+
+	skipwhitespace(p);
+	char c = p->buf[p->pos];
+	if (c == '-' || c == '+') {
+		p->pos++;
+		x = expression(p, skip, 3);
+		if (c == '-' && x.reloc >= 0) die(p, "In an object file, a label's address can't be negated");
+		if (c == '-') x.value = (int)(0u - (unsigned)x.value);
+	} else if (c == '(') {
+		p->pos++;
+		x = expression(p, skip, 0);
+		skipwhitespace(p);
+		if (p->buf[p->pos] != ')') die(p, "Missing closing parenthesis");
+		p->pos++;
+	} else if (c >= '0' && c <= '9') {
+		try_parse_intlit(p, &x.value);
+	} else if (try_parse_identifier(p, &t.s_len, &t.s)) {
+		if (idcmp(t, "sizeof")) {
+			skipwhitespace(p);
+			if (p->buf[p->pos] != '(') die(p, "sizeof must be followed by a label in parentheses");
+			p->pos++;
+			skipwhitespace(p);
+			if (!try_parse_identifier(p, &t.s_len, &t.s)) die(p, "sizeof must be followed by a label in parentheses");
+			skipwhitespace(p);
+			if (p->buf[p->pos] != ')') die(p, "Missing closing parenthesis");
+			p->pos++;
+
+			int i = skip ? -1 : find_label(p->labels, p->nlabels, t);
+			if (skip) x.value = 0;
+			else if (i < 0 || p->labels[i].equ) die(p, "sizeof needs a label defined in this file: %.*s", t.s_len, t.s);
+			else if (!p->code_end) die(p, "sizeof can't be used here, as the sizes of labels aren't known yet");
+			else x.value = label_size(p, i);
+		} else {
+			x = symbol_value(p, t, skip);
+		}
+	} else die(p, "Invalid expression");
+
+	int op;
+	while ((op = binary_operator(p)) > prec) {
+		char o = p->buf[p->pos];
+		p->pos += op == 1 ? 2 : 1;
+		expr_value y = expression(p, skip, op);
+		x = skip ? (expr_value){.reloc = -1} : combine(p, o, x, y);
+	}
+	return x;
+}
+
+// evaluate an expression for the word at the current memory position
+static int emit_expression(parse_ctx *p)
+{
+	expr_value v = expression(p, 0, 0);
+	if (v.reloc >= 0) add_reloc(p, v.reloc, v.sym);
+	return v.value;
+}
+
+// an equ statement: the name is a constant whose value is evaluated when it's used
+static void add_equ(parse_ctx *p, token t, int add)
+{
+	skipwhitespace(p);
+	if (add) {
+		add_label(p, t, p->pos);
+		p->labels[p->nlabels-1].equ = EQU_EXPR;
+	}
+	(void)expression(p, 1, 0);
+	if (tok_next(p).type != TOK_EOL) die(p, "Invalid expression (newline must follow)");
+}
+
+
+static void zeros(parse_ctx *p, evm_word *mem)
+{
+	p->in_zeros = 1;
+	expr_value n = expression(p, 0, 0);
+	p->in_zeros = 0;
+	if (n.reloc >= 0 || n.value < 0) die(p, "zeros needs a number of words");
+	if (tok_next(p).type != TOK_EOL) die(p, "Invalid expression (newline must follow)");
+	room(p, n.value);
+	for (int i = 0; i < n.value; i++) {
+		mem[p->mempos].i = 0;
+		p->mempos += 1;
+	}
+}
+
+// a data word whose value is an expression, evaluated after pass 1
+static void pending(parse_ctx *p)
+{
+	room(p, 1);
+	skipwhitespace(p);
+	p->pending = grow(p->pending, &p->maxpending, p->npending+1, ssizeof(pending_word));
+	p->pending[p->npending++] = (pending_word){.where = p->mempos, .pos = p->pos};
+	p->mempos += 1;
+	(void)expression(p, 1, 0);
+	if (tok_next(p).type != TOK_EOL) die(p, "Invalid expression (newline must follow)");
+}
 
 int data(parse_ctx *p, evm_word *mem)
 {
@@ -319,18 +725,19 @@ int data(parse_ctx *p, evm_word *mem)
 	else if (
 		t[0].type == TOK_ID &&
 		t[1].type == TOK_COLON && 
-		idcmp(t[2], "zeros") &&
-		t[3].type == TOK_INTLIT &&
-		t[4].type == TOK_EOL
+		idcmp(t[2], "zeros")
 		) 
 	{ 
 		// labeled zeros statement
 		add_label(p, t[0], p->mempos);
-		for (int i = 0; i < t[3].i; i++) {
-			mem[p->mempos].i = 0;
-			p->mempos += 1;
-		}
-		swallow(p, 5);
+		swallow(p, 3);
+		zeros(p, mem);
+		return 1;
+	}
+
+	else if (t[0].type == TOK_ID && idcmp(t[1], "equ")) {
+		swallow(p, 2);
+		add_equ(p, t[0], 1);
 		return 1;
 	}
 
@@ -342,6 +749,7 @@ int data(parse_ctx *p, evm_word *mem)
 		) 
 	{
 		// labeled int literal
+		room(p, 1);
 		add_label(p, t[0], p->mempos);
 		mem[p->mempos].i = t[2].i;
 		p->mempos += 1;
@@ -357,6 +765,7 @@ int data(parse_ctx *p, evm_word *mem)
 		) 
 	{
 		// labeled float literal
+		room(p, 1);
 		add_label(p, t[0], p->mempos);
 		mem[p->mempos].f = t[2].f;
 		p->mempos += 1;
@@ -372,6 +781,7 @@ int data(parse_ctx *p, evm_word *mem)
 		) 
 	{
 		// labeled string literal
+		room(p, (t[2].s_len+3)/4);
 		add_label(p, t[0], p->mempos);
 		memcpy(mem+p->mempos, t[2].s, t[2].s_len);
 		p->mempos += t[2].s_len/4;
@@ -380,18 +790,10 @@ int data(parse_ctx *p, evm_word *mem)
 		return 1;
 	}
 
-	else if (
-		idcmp(t[0], "zeros") &&
-		t[1].type == TOK_INTLIT &&
-		t[2].type == TOK_EOL
-		) 
-	{
+	else if (idcmp(t[0], "zeros")) {
 		// unlabeled zeros statement
-		for (int i = 0; i < t[1].i; i++) {
-			mem[p->mempos].i = 0;
-			p->mempos += 1;
-		}
-		swallow(p, 3);
+		swallow(p, 1);
+		zeros(p, mem);
 		return 1;
 	}
 
@@ -401,6 +803,7 @@ int data(parse_ctx *p, evm_word *mem)
 		) 
 	{
 		// unlabeled int literal
+		room(p, 1);
 		mem[p->mempos].i = t[0].i;
 		p->mempos += 1;
 		swallow(p, 2);
@@ -413,6 +816,7 @@ int data(parse_ctx *p, evm_word *mem)
 		) 
 	{
 		// unlabeled float literal
+		room(p, 1);
 		mem[p->mempos].f = t[0].f;
 		p->mempos += 1;
 		swallow(p, 2);
@@ -425,6 +829,7 @@ int data(parse_ctx *p, evm_word *mem)
 		) 
 	{
 		// unlabeled string literal
+		room(p, (t[0].s_len+3)/4);
 		memcpy(mem+p->mempos, t[0].s, t[0].s_len);
 		p->mempos += t[0].s_len/4;
 		if(t[0].s_len % 4) p->mempos++;
@@ -432,35 +837,67 @@ int data(parse_ctx *p, evm_word *mem)
 		return 1;
 	}
 
+	else if (idcmp(t[0], "export") && t[1].type == TOK_ID && t[2].type == TOK_EOL) {
+		add_export(p, t[1]);
+		swallow(p, 3);
+		return 1;
+	}
+
 	else if (idcmp(t[0], "start") && t[1].type == TOK_EOL) {
 		swallow(p, 2);
 		return 0;
 	}
 
+	else if (
+		t[0].type == TOK_ID &&
+		t[1].type == TOK_COLON &&
+		(t[2].type == TOK_INTLIT || t[2].type == TOK_ID || t[2].type == TOK_OPERATOR)
+		) 
+	{
+		// labeled expression
+		add_label(p, t[0], p->mempos);
+		swallow(p, 2);
+		pending(p);
+		return 1;
+	}
+
+	else if (
+		(t[0].type == TOK_INTLIT || t[0].type == TOK_ID || t[0].type == TOK_OPERATOR) &&
+		!idcmp(t[0], "start")
+		) 
+	{
+		// unlabeled expression
+		pending(p);
+		return 1;
+	}
+
 	die(p, "Invalid line in data section");
 }
 
 int parsereg(token t)
 {
 	if (t.type != TOK_ID) return -1;
-	if (t.s_len != 2) return -1;
-	if(!memcmp(t.s, "sp", 2)) return 0;
-	char n[2] = {t.s[1], 0};
-	int r = atoi(n);
-	if (r < 1) return -1;
-	if (r > EVM_NUMREGS) return -1;
+	if (t.s_len == 2 && !memcmp(t.s, "sp", 2)) return 0;
+	if (t.s_len < 2 || t.s_len > 3 || t.s[0] != 'r' || t.s[1] == '0') return -1;
+	int r = 0;
+	for (int i = 1; i < t.s_len; i++) {
+		if (t.s[i] < '0' || t.s[i] > '9') return -1;
+		r = r*10 + t.s[i] - '0';
+	}
+	if (r > EVM_MAXREGS) return -1;
 	return r;
 }
 
 void checkarg(parse_ctx *p, token t, evm_op_t op, int argno)
 {
+	// addresses and integers can be expressions
+	int expr = t.type == TOK_INTLIT || t.type == TOK_OPERATOR || (t.type == TOK_ID && parsereg(t) < 0);
 	if (op.argtypes[argno] == EVM_REG && t.type == TOK_ID && (parsereg(t) >= 0)) return;
-	if (op.argtypes[argno] == EVM_MEM && t.type == TOK_ID) return;
-	if (op.argtypes[argno] == EVM_MEM && t.type == TOK_INTLIT) return;
-	if (op.argtypes[argno] == EVM_IMMI && t.type == TOK_INTLIT) return;
+	if (op.argtypes[argno] == EVM_MEM && expr) return;
+	if (op.argtypes[argno] == EVM_IMMI && expr) return;
 	if (op.argtypes[argno] == EVM_IMMF && t.type == TOK_FLOATLIT) return;
 		
-	die(p, "%s instruction first argument must be %s", op.str,
+	die(p, "%s instruction %s argument must be %s", op.str, argno ? "second" : "first",
 			op.argtypes[argno] == EVM_REG ? "a register" : 
 			op.argtypes[argno] == EVM_MEM ? "a label or memory address" :
 			op.argtypes[argno] == EVM_IMMI ? "an immediate value (integer)" :
@@ -468,24 +905,26 @@ void checkarg(parse_ctx *p, token t, evm_op_t op, int argno)
 
 }
 
-int emit_argument(parse_ctx *p, evm_op_t op, token t, int a)
+// parse argument a of an instruction, for the word at the current memory position
+int emit_argument(parse_ctx *p, evm_op_t op, int a, int pass)
 {
+	parse_ctx tmp = *p;
+	token t = tok_next(&tmp);
+	checkarg(p, t, op, a);
+
 	if (op.argtypes[a] == EVM_REG) {
 		int r = parsereg(t);
 		if (r<0) die(p, "Invalid register (argument %i)", a+1);
+		if (r > p->maxreg) p->maxreg = r;
+		*p = tmp;
 		return r;
 	} else 
-	if (op.argtypes[a] == EVM_MEM) {
-		if (t.type == TOK_ID) {
-			return lookup(p, t);
-		} else if (t.type == TOK_INTLIT) {
-			return t.i;
-		} else assert(0);
-	} else 
-	if (op.argtypes[a] == EVM_IMMI) {
-		return t.i;
+	if (op.argtypes[a] == EVM_MEM || op.argtypes[a] == EVM_IMMI) {
+		if (pass == 1) return expression(p, 1, 0).value;
+		return emit_expression(p);
 	} else 
 	if (op.argtypes[a] == EVM_IMMF) {
+		*p = tmp;
 		return t.i; // haha
 	} else assert(0);
 }
@@ -520,6 +959,18 @@ int statement(parse_ctx *p, int pass, evm_word *mem)
 		return 1;
 	}
 
+	else if (idcmp(t[0], "export") && t[1].type == TOK_ID && t[2].type == TOK_EOL) {
+		if(pass == 1) add_export(p, t[1]);
+		swallow(p,3);
+		return 1;
+	}
+
+	else if (t[0].type == TOK_ID && idcmp(t[1], "equ")) {
+		swallow(p,2);
+		add_equ(p, t[0], pass == 1);
+		return 1;
+	}
+
 	else if (t[0].type == TOK_ID)
 	{
 		// potentially an instruction
@@ -529,66 +980,25 @@ int statement(parse_ctx *p, int pass, evm_word *mem)
 			assert(op.opcode == i);
 
 			if (idcmp(t[0],op.str)) {
-				
-				if (op.nargs == 0) {
-					if (t[1].type != TOK_EOL) {
-						die(p, "%s instruction takes no arguments (newline must follow)", op.str);
-					}
-					
-					if (pass == 2) {
-						mem[p->mempos].i = op.opcode;
-					}
-					p->mempos += 1;
-
-					swallow(p,2);
-					return 1;
-				}
-
-				if (op.nargs == 1) {
-					checkarg(p, t[1], op, 0);
-					if (t[2].type != TOK_EOL) {
-						die(p, "%s instruction takes one argument (newline must follow)", op.str);
-					}
-
-					if (pass == 2) {
-						mem[p->mempos].i = op.opcode;
-						p->mempos += 1;
-						mem[p->mempos].i = emit_argument(p, op, t[1], 0);
-						p->mempos += 1;
-					}
-					else p->mempos += 2;
-
-					swallow(p,3);
-					return 1;
-				}
+				room(p, 1 + op.nargs);
+				swallow(p,1);
+				if (pass == 2) mem[p->mempos].i = op.opcode;
+				p->mempos += 1;
 
-				if (op.nargs == 2) {
-					checkarg(p, t[1], op, 0);
-					if (t[2].type != TOK_COMMA) {
+				for (int a = 0; a < op.nargs; a++) {
+					if (a > 0 && tok_next(p).type != TOK_COMMA) {
 						die(p, "instruction arguments must be separated by a comma");
 					}
-					checkarg(p, t[3], op, 1);
-
-					if (pass == 2) {
-						mem[p->mempos].i = op.opcode;
-						p->mempos += 1;
-						for (int a = 0; a < 2; a++) {
-							token argtok = a == 0 ? t[1] : t[3];
-							mem[p->mempos].i = emit_argument(p, op, argtok, a);
-							p->mempos += 1;
-						}
-					}
-					else p->mempos += 3;
-					
-					if (t[4].type != TOK_EOL) {
-						die(p, "%s instruction takes one argument (newline must follow)", op.str);
-					}
-					swallow(p,5);
-					return 1;
+					int arg = emit_argument(p, op, a, pass);
+					if (pass == 2) mem[p->mempos].i = arg;
+					p->mempos += 1;
 				}
 
-				assert(0);
-
+				if (tok_next(p).type != TOK_EOL) {
+					die(p, "%s instruction takes %s (newline must follow)", op.str, 
+						op.nargs == 0 ? "no arguments" : op.nargs == 1 ? "one argument" : "two arguments");
+				}
+				return 1;
 			}
 		}
 		die(p, "Invalid instruction");
@@ -597,30 +1007,208 @@ int statement(parse_ctx *p, int pass, evm_word *mem)
 	die(p, "Invalid source line");
 }
 
-const char *assemble(int bufsz, char *buf)
+static evm_sym *obj_syms(evm_obj *o)
+{
+	return (evm_sym*)(o->mem + o->len_data + o->len_code);
+}
+
+static evm_reloc *obj_relocs(evm_obj *o)
 {
-	const int allocsz = 1<<20;
-	evm_mem *img = malloc(allocsz);
+	return (evm_reloc*)(obj_syms(o) + o->nsyms);
+}
+
+static void write_object(parse_ctx *p, evm_mem *img)
+{
+	evm_obj hdr = {
+		.magic    = EVM_OBJ_MAGIC,
+		.version  = img->version,
+		.len_data = img->len_data,
+		.len_code = img->len_code,
+		.nsyms    = p->nexports + p->nimports,
+		.nrelocs  = p->nrelocs,
+	};
+	fwrite(&hdr, 1, ssizeof(hdr), stdout);
+	fwrite(img->mem, 4, img->len_data + img->len_code, stdout);
+
+	for (int i = 0; i < p->nexports; i++) {
+		label e = p->exports[i];
+		token t = {.type = TOK_ID, .s = e.s, .s_len = e.len};
+		int k = find_label(p->labels, p->nlabels, t);
+		if (k < 0) 
+			die(0, "Exported label %.*s is not defined", e.len, e.s);
+		if (p->labels[k].equ) 
+			die(0, "Exported label %.*s is an equ constant, not an address", e.len, e.s);
+		if (e.len >= EVM_SYMLEN) 
+			die(0, "Exported label %.*s is too long (max %i characters)", e.len, e.s, EVM_SYMLEN-1);
+
+		evm_sym sym = {
+			.where = p->labels[k].where,
+			.flags = SYM_EXPORT | (p->labels[k].code ? SYM_CODE : 0),
+		};
+		memcpy(sym.name, e.s, e.len);
+		fwrite(&sym, 1, ssizeof(sym), stdout);
+	}
+
+	for (int i = 0; i < p->nimports; i++) {
+		label e = p->imports[i];
+		if (e.len >= EVM_SYMLEN) 
+			die(0, "Imported label %.*s is too long (max %i characters)", e.len, e.s, EVM_SYMLEN-1);
+
+		evm_sym sym = {.flags = SYM_IMPORT};
+		memcpy(sym.name, e.s, e.len);
+		fwrite(&sym, 1, ssizeof(sym), stdout);
+	}
+
+	for (int i = 0; i < p->nrelocs; i++) {
+		evm_reloc r = p->relocs[i];
+		if (r.kind == RELOC_IMPORT) r.sym += p->nexports;
+		fwrite(&r, 1, ssizeof(r), stdout);
+	}
+}
+
+// the hash that ties debug info to an image: the code, and where it is
+static unsigned long long debug_key(evm_mem *img)
+{
+	unsigned long long h = 0xcbf29ce484222325ULL;
+	h = fnv1a(h, &img->len_data, ssizeof(img->len_data));
+	h = fnv1a(h, &img->len_code, ssizeof(img->len_code));
+	h = fnv1a(h, img->mem + img->len_data, 4LL*img->len_code);
+	return h;
+}
+
+static int cmp_debug_label(const void *a, const void *b)
+{
+	const debug_label *x = a, *y = b;
+	if (x->where != y->where) return x->where < y->where ? -1 : 1;
+	return (x->size > y->size) - (x->size < y->size);
+}
+
+static void write_debug_info(parse_ctx *p, evm_mem *img, const char *fname, const char *source)
+{
+	FILE *f = fopen(fname, "wb");
+	if (!f) die(0, "couldn't open %s for writing", fname);
+
+	// equ constants aren't addresses, so they aren't included
+	int n = 0;
+	debug_label *labels = malloc(ssizeof(debug_label) * (p->nlabels+1));
+	if (!labels) die(0, "out of memory");
+	int strsz = (int)strlen(source) + 1;
+	for (int i = 0; i < p->nlabels; i++) {
+		if (p->labels[i].equ) continue;
+		labels[n++] = (debug_label){.where = p->labels[i].where, .name = strsz, .code = p->labels[i].code};
+		strsz += p->labels[i].len + 1;
+	}
+
+	// a label reaches up to the next one in its segment
+	qsort(labels, n, sizeof(*labels), cmp_debug_label);
+	for (int i = 0, k = 0; i < n; i++) {
+		while (k < n && labels[k].where <= labels[i].where) k++;
+		int end = labels[i].code ? img->len_data + img->len_code : img->len_data;
+		if (k < n && labels[k].code == labels[i].code) end = labels[k].where;
+		labels[i].size = end - labels[i].where;
+	}
+	qsort(labels, n, sizeof(*labels), cmp_debug_label);
+
+	evm_debug_hdr hdr = {
+		.magic   = EVM_DEBUG_MAGIC,
+		.nlines  = p->nlines,
+		.nlabels = n,
+		.strsz   = strsz,
+		.key     = debug_key(img),
+	};
+	fwrite(&hdr, 1, ssizeof(hdr), f);
+	fwrite(p->lines, ssizeof(debug_line), p->nlines, f);
+	fwrite(labels, ssizeof(debug_label), n, f);
+	fwrite(source, 1, strlen(source) + 1, f);
+	for (int i = 0; i < p->nlabels; i++) {
+		if (p->labels[i].equ) continue;
+		fwrite(p->labels[i].s, 1, p->labels[i].len, f);
+		fputc(0, f);
+	}
+	if (fclose(f)) die(0, "couldn't write %s", fname);
+	free(labels);
+}
+
+// the source line that the parser is at, counted from where it last was
+static int source_line(parse_ctx *p)
+{
+	if (p->pos < p->linepos) p->line = p->linepos = 0;
+	for (; p->linepos < p->pos; p->linepos++) 
+		if (p->buf[p->linepos] == '\n') p->line++;
+	return p->line + 1;
+}
+
+// a data line (pass 0) or a statement, noting where its words came from
+static int source_statement(parse_ctx *p, int pass, evm_word *mem)
+{
+	int where = p->mempos;
+	int line = p->debug ? source_line(p) : 0;
+	int more = pass ? statement(p, pass, mem) : data(p, mem);
+	if (p->debug && pass != 1 && p->mempos > where) {
+		p->lines = grow(p->lines, &p->maxlines, p->nlines+1, ssizeof(debug_line));
+		p->lines[p->nlines++] = (debug_line){.where = where, .line = line};
+	}
+	return more;
+}
+
+// assemble a source file into a malloc'd image
+evm_mem *assemble_image(parse_ctx *p)
+{
+	evm_mem *img = malloc(MAX_IMAGE_BYTES);
 	if(!img) die(0, "out of memory");
 	img->magic = EVM_MAGIC;
 	img->version = 1;
+	p->memwords = (MAX_IMAGE_BYTES - ssizeof(*img))/4;
 
-	parse_ctx p = {.bufsz=bufsz, .buf=buf};
-	while (data(&p, img->mem));
-	assert(p.mempos < allocsz);
-	img->len_data = p.mempos;
+	while (source_statement(p, 0, img->mem));
+	img->len_data = p->mempos;
+	p->in_code = 1;
+
+	parse_ctx p_backup = *p;
+	while (source_statement(p, 1, img->mem));
+	p->data_end = img->len_data;
+	p->code_end = p->mempos;
+
+	// now that all labels are known
+	for (int i = 0; i < p->npending; i++) {
+		p->pos = p->pending[i].pos;
+		p->mempos = p->pending[i].where;
+		img->mem[p->mempos].i = emit_expression(p);
+	}
+
+	p->pos = p_backup.pos;
+	p->mempos = p_backup.mempos;
+	while (source_statement(p, 2, img->mem));
+	img->len_code = p->mempos - img->len_data;
+	// images that only use the first registers don't declare it
+	if (p->maxreg > EVM_NUMREGS) img->version |= p->maxreg << EVM_REGS_SHIFT;
+
+	return img;
+}
+
+void free_parse_ctx(parse_ctx *p)
+{
+	free(p->labels);
+	free(p->exports);
+	free(p->imports);
+	free(p->relocs);
+	free(p->lines);
+	free(p->pending);
+}
 
-	parse_ctx p_backup = p;
-	while (statement(&p, 1, img->mem));
-	assert(p.mempos < allocsz);
+// debug info is written to debug_file, if given, naming source as the source file
+const char *assemble(int bufsz, char *buf, int object, const char *debug_file, const char *source)
+{
+	if (object && debug_file) return "debug info (-g) can only be written for images (-a), not object files";
+	parse_ctx p = {.bufsz=bufsz, .buf=buf, .object=object, .debug = !!debug_file};
+	evm_mem *img = assemble_image(&p);
 
-	p.pos = p_backup.pos;
-	p.mempos = p_backup.mempos;
-	while (statement(&p, 2, img->mem));
-	assert(p.mempos < allocsz);
-	img->len_code = p.mempos - img->len_data;
+	if (object) write_object(&p, img);
+	else fwrite(img, 1, ssizeof(*img) + 4LL*p.mempos, stdout);
+	if (debug_file) write_debug_info(&p, img, debug_file, source);
 
-	fwrite(img, 1, ssizeof(*img) + 4*p.mempos, stdout);
+	free(img);
+	free_parse_ctx(&p);
 	return 0;
 
 	/* Debug the tokenizer 
@@ -661,6 +1249,9 @@ const char *assemble(int bufsz, char *buf)
 		case TOK_COLON:
 			printf("TOK_COLON\n");
 			break;
+		case TOK_OPERATOR:
+			printf("TOK_OPERATOR\n");
+			break;
 		case TOK_EOF:
 			printf("TOK_EOF\n");
 			cont = 0;
@@ -676,194 +1267,4522 @@ const char *assemble(int bufsz, char *buf)
 	*/
 }
 
-const char *disassemble(int bufsz, unsigned char *buf, int ip)
+// formatted append to a string buffer, never overflows
+static void bprintf(char *out, int outsz, int *len, const char *fmt, ...)
 {
-	evm_mem *img = (evm_mem*)buf;	
-	const char *errmsg = validate_evm_mem(bufsz, img);
-	if (errmsg) return errmsg;
+	if (*len >= outsz) return;
+	va_list va;
+	va_start(va, fmt);
+	int n = vsnprintf(out + *len, outsz - *len, fmt, va);
+	va_end(va);
+	if (n > 0) *len = *len + n < outsz ? *len + n : outsz - 1;
+}
 
-	evm_word *mem = img->mem;
+// debug info loaded with -g, if any
+static struct {
+	evm_debug_hdr *hdr;
+	debug_line *lines;
+	debug_label *labels;
+	const char *names;
+} debug;
 
-	printf("--- DATA SECTION ---------------------------------\n");
-	printf("address     hex        decimal int      float   ascii\n");
-	for (int i = 0; i < img->len_data; i++)
-	{
-		char ascii[5] = {0};
-		memcpy(ascii, &mem[i], 4);
-		for(int i = 0; i < 4; i++) 
-			ascii[i] = (ascii[i] > 31 && ascii[i] < 127) ? ascii[i] : '.';
-		printf("%.8x:   %.8x   %11i   %8f   %s\n", i, mem[i].u, mem[i].i, mem[i].f, ascii);
+// the label that addr is in, and how far into it, or 0
+static const char *debug_label_at(int addr, int *offset)
+{
+	if (!debug.hdr) return 0;
+	int lo = 0, hi = debug.hdr->nlabels;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (debug.labels[mid].where <= addr) lo = mid + 1;
+		else hi = mid;
+	}
+	if (!lo) return 0;
+	debug_label *l = &debug.labels[lo-1];
+	if (addr != l->where && addr >= l->where + l->size) return 0;
+	*offset = addr - l->where;
+	return debug.names + l->name;
+}
+
+// the source line of the statement at addr, or 0
+static int debug_line_at(int addr)
+{
+	if (!debug.hdr) return 0;
+	int lo = 0, hi = debug.hdr->nlines;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (debug.lines[mid].where <= addr) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo ? debug.lines[lo-1].line : 0;
+}
+
+// the address of a label, or -1
+static int debug_address(const char *name, int len)
+{
+	if (!debug.hdr) return -1;
+	for (int i = 0; i < debug.hdr->nlabels; i++) {
+		const char *s = debug.names + debug.labels[i].name;
+		if (!strncmp(s, name, len) && !s[len]) return debug.labels[i].where;
+	}
+	return -1;
+}
+
+// append " <label+offset>" if addr is in a label
+static void symbolize(char *out, int outsz, int *len, int addr)
+{
+	int offset;
+	const char *name = debug_label_at(addr, &offset);
+	if (!name) return;
+	if (offset) bprintf(out, outsz, len, " <%s+%i>", name, offset);
+	else bprintf(out, outsz, len, " <%s>", name);
+}
+
+// append " <label+offset> file:line" for a code address
+static void source_location(char *out, int outsz, int *len, int addr)
+{
+	symbolize(out, outsz, len, addr);
+	int line = debug_line_at(addr);
+	if (line) bprintf(out, outsz, len, " %s:%i", debug.names, line);
+}
+
+static void disasm_arg(char *out, int outsz, int *len, evm_arg_type type, evm_word arg)
+{
+	if (type == EVM_REG) {
+		if(arg.i == 0)
+			bprintf(out, outsz, len, "sp");
+		else
+			bprintf(out, outsz, len, "r%i", arg.i);
+	} else if (type == EVM_MEM) {
+		bprintf(out, outsz, len, "%x", arg.u);
+		symbolize(out, outsz, len, arg.i);
+	} else if (type == EVM_IMMI) {
+		bprintf(out, outsz, len, "%i", arg.i);
+	} else if (type == EVM_IMMF) {
+		bprintf(out, outsz, len, "%f", arg.f);
+	} else assert(0);
+}
+
+/*
+	Format the instruction at address i as one line of disassembly (without a
+	newline). Returns the length of the instruction in words, or 0 if the
+	opcode is illegal.
+*/
+int disasm_insn(char *out, int outsz, evm_word *mem, int i, char indicator)
+{
+	int len = 0;
+	out[0] = 0;
+
+	int op = mem[i].i;
+	if (op < OP_STOP || op >= OP_INVAL) return 0;
+	assert(evm_ops[op].opcode == op);
+
+	// the address
+	bprintf(out, outsz, &len, "%.8x:   ", i);
+
+	// the actual memory in hex
+	bprintf(out, outsz, &len, "%.8x ", op);
+	if (evm_ops[op].nargs > 0) 
+		bprintf(out, outsz, &len, "%.8x ", mem[i+1].u);
+	else 
+		bprintf(out, outsz, &len, "         ");
+
+	if (evm_ops[op].nargs == 2) 
+		bprintf(out, outsz, &len, "%.8x %c%c", mem[i+2].u, indicator, indicator);
+	else 
+		bprintf(out, outsz, &len, "         %c%c", indicator, indicator);
+
+	// the disassembly 
+	bprintf(out, outsz, &len, "%-8s", evm_ops[op].str);
+
+	if (evm_ops[op].nargs > 0) 
+	{
+		disasm_arg(out, outsz, &len, evm_ops[op].argtypes[0], mem[i+1]);
+		if (evm_ops[op].nargs > 1) 
+		{
+			bprintf(out, outsz, &len, ", ");
+			disasm_arg(out, outsz, &len, evm_ops[op].argtypes[1], mem[i+2]);
+		}
+	}
+
+	return 1 + evm_ops[op].nargs;
+}
+
+static void disasm_data_word(char *out, int outsz, evm_word *mem, int i)
+{
+	char ascii[5] = {0};
+	memcpy(ascii, &mem[i], 4);
+	for(int k = 0; k < 4; k++) 
+		ascii[k] = (ascii[k] > 31 && ascii[k] < 127) ? ascii[k] : '.';
+	int len = 0;
+	bprintf(out, outsz, &len, "%.8x:   %.8x   %11i   %8f   %s", i, mem[i].u, mem[i].i, mem[i].f, ascii);
+	symbolize(out, outsz, &len, i);
+}
+
+// a "label:" line for every label that starts at addr
+static void print_labels(FILE *out, int addr)
+{
+	if (!debug.hdr) return;
+	int lo = 0, hi = debug.hdr->nlabels;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (debug.labels[mid].where < addr) lo = mid + 1;
+		else hi = mid;
+	}
+	for (; lo < debug.hdr->nlabels && debug.labels[lo].where == addr; lo++) 
+		fprintf(out, "%s:\n", debug.names + debug.labels[lo].name);
+}
+
+const char *disassemble(int bufsz, unsigned char *buf, int ip)
+{
+	evm_mem *img = (evm_mem*)buf;	
+	const char *errmsg = validate_evm_mem(bufsz, img);
+	if (errmsg) return errmsg;
+
+	evm_word *mem = img->mem;
+	char line[256];
+
+	printf("--- DATA SECTION ---------------------------------\n");
+	printf("address     hex        decimal int      float   ascii\n");
+	for (int i = 0; i < img->len_data; i++)
+	{
+		disasm_data_word(line, ssizeof(line), mem, i);
+		printf("%s\n", line);
+	}
+	printf("--- CODE SECTION ---------------------------------\n");
+	if (evm_numregs(img) != EVM_NUMREGS) printf("(%i registers)\n", evm_numregs(img));
+	int i = img->len_data;
+
+	while (i < img->len_code+img->len_data)
+	{
+		int n = disasm_insn(line, ssizeof(line), mem, i, i == ip ? '>' : ' ');
+		if (!n) die(0, "Illegal instruction 0x%0.8x", mem[i].i);
+		print_labels(stdout, i);
+		printf("%s\n", line);
+		i += n;
+	}
+
+	return 0;
+}
+
+/*
+	Bytecode optimizer (-O)
+
+	Works on an assembled image. The code segment is decoded into a list of
+	instructions, which are split into basic blocks at jump targets and after
+	jumps. A handful of simple passes are repeated until nothing changes:
+
+	- jump threading (jumps to unconditional jumps, jumps to the next instruction)
+	- removal of unreachable code
+	- constant propagation and folding within a basic block, including
+	  conditional jumps on known values
+	- forwarding of stored values to later loads of the same address, and
+	  removal of stores that write a value the address already holds
+	- removal of stores that are overwritten before they can be read
+	- removal of instructions whose result register is never read
+
+	The data segment is left alone, so data addresses don't change. Code is
+	compacted and jump targets are remapped, which is safe because code
+	addresses can only ever be used as jump targets.
+*/
+
+typedef struct {
+	int op;
+	int a[2];
+	int addr;
+	int dead;
+} insn;
+
+static int is_jump(int op)
+{
+	return op >= OP_JP && op <= OP_J;
+}
+
+static int jump_target(insn *in)
+{
+	return in->op == OP_J ? in->a[0] : in->a[1];
+}
+
+static void set_jump_target(insn *in, int target)
+{
+	if (in->op == OP_J) in->a[0] = target;
+	else in->a[1] = target;
+}
+
+static int falls_through(int op)
+{
+	return op != OP_STOP && op != OP_J && op != OP_TRAP;
+}
+
+static int branch_taken(int op, int v)
+{
+	switch (op) {
+	case OP_JP:  return v > 0;
+	case OP_JPZ: return v >= 0;
+	case OP_JZ:  return v == 0;
+	case OP_JN:  return v < 0;
+	case OP_JNZ: return v <= 0;
+	case OP_J:   return 1;
+	default: assert(0); return 0;
+	}
+}
+
+// decode the code segment of a validated image; returns 0 if it contains invalid instructions
+static insn *decode_code(evm_mem *img, int *ninsns)
+{
+	int start_code = img->len_data;
+	int end_code = start_code + img->len_code;
+	evm_word *mem = img->mem;
+
+	insn *code = malloc(ssizeof(insn) * (img->len_code + 1));
+	if (!code) die(0, "out of memory");
+
+	int n = 0;
+	for (int i = start_code; i < end_code; n++) {
+		int op = mem[i].i;
+		if (op < OP_STOP || op >= OP_INVAL || i + evm_ops[op].nargs >= end_code) {
+			free(code);
+			return 0;
+		}
+		code[n] = (insn){.op = op, .addr = i};
+		for (int k = 0; k < evm_ops[op].nargs; k++) 
+			code[n].a[k] = mem[i+1+k].i;
+		i += 1 + evm_ops[op].nargs;
+	}
+	*ninsns = n;
+	return code;
+}
+
+// index of the instruction at a code address, or -1
+static int insn_at(insn *code, int n, int addr)
+{
+	int lo = 0, hi = n-1;
+	while (lo <= hi) {
+		int mid = (lo+hi)/2;
+		if (code[mid].addr == addr) return mid;
+		if (code[mid].addr < addr) lo = mid+1;
+		else hi = mid-1;
+	}
+	return -1;
+}
+
+// mark the first instruction of every basic block
+static void find_leaders(insn *code, int n, char *leader)
+{
+	memset(leader, 0, n);
+	if (n) leader[0] = 1;
+	for (int i = 0; i < n; i++) {
+		if (!is_jump(code[i].op) && code[i].op != OP_STOP) continue;
+		if (i+1 < n) leader[i+1] = 1;
+		if (is_jump(code[i].op)) {
+			int t = insn_at(code, n, jump_target(&code[i]));
+			if (t >= 0) leader[t] = 1;
+		}
+	}
+}
+
+typedef unsigned long long regmask;
+#define REGBIT(x) (1ULL << (x))
+
+static regmask insn_uses(insn *in)
+{
+	switch (in->op) {
+	case OP_SET: case OP_FSET: case OP_LDA: case OP_LD: 
+	case OP_STOP: case OP_NOP: case OP_J: case OP_TRAP:
+		return 0;
+	case OP_CPY: case OP_ST: case OP_LDD: case OP_ALD:
+		return REGBIT(in->a[1]);
+	case OP_STD: case OP_XADD: case OP_AST:
+		return REGBIT(in->a[0]) | REGBIT(in->a[1]);
+	case OP_CAS:
+		return REGBIT(in->a[0]) | REGBIT(in->a[1]) | REGBIT(1);
+	case OP_PUSH:
+		return REGBIT(in->a[0]) | REGBIT(0);
+	case OP_POP:
+		return REGBIT(0);
+	case OP_SYSCALL:
+		return ~0ULL;
+	case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV:
+	case OP_FADD: case OP_FSUB: case OP_FMUL: case OP_FDIV:
+	case OP_AND: case OP_OR: case OP_XOR:
+		return REGBIT(in->a[0]) | REGBIT(in->a[1]);
+	default: // unary ops, conditional jumps, put
+		return REGBIT(in->a[0]);
+	}
+}
+
+static regmask insn_defs(insn *in)
+{
+	switch (in->op) {
+	case OP_SET: case OP_FSET: case OP_LDA: case OP_LD: case OP_CPY: case OP_LDD: case OP_ALD:
+	case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV:
+	case OP_FADD: case OP_FSUB: case OP_FMUL: case OP_FDIV:
+	case OP_AND: case OP_OR: case OP_XOR:
+	case OP_NOT: case OP_LNOT: case OP_CVTFI: case OP_CVTIF:
+		return REGBIT(in->a[0]);
+	case OP_PUSH:
+		return REGBIT(0);
+	case OP_POP:
+		return REGBIT(in->a[0]) | REGBIT(0);
+	case OP_XADD:
+		return REGBIT(in->a[1]);
+	case OP_CAS:
+		return REGBIT(1);
+	case OP_SYSCALL:
+		return ~0ULL;
+	default:
+		return 0;
+	}
+}
+
+// evaluate an instruction on known register values; returns 0 if it can't be folded
+static int fold(int op, evm_word *d, evm_word s)
+{
+	evm_word x = *d;
+	switch (op) {
+	case OP_ADD:   x.u = x.u + s.u; break;
+	case OP_SUB:   x.u = x.u - s.u; break;
+	case OP_MUL:   x.u = x.u * s.u; break;
+	case OP_DIV:   
+		if (s.i == 0 || (s.i == -1 && x.u == 0x80000000u)) return 0;
+		x.i = x.i / s.i; 
+		break;
+	case OP_FADD:  x.f += s.f; break;
+	case OP_FSUB:  x.f -= s.f; break;
+	case OP_FMUL:  x.f *= s.f; break;
+	case OP_FDIV:  x.f /= s.f; break;
+	case OP_AND:   x.u &= s.u; break;
+	case OP_OR:    x.u |= s.u; break;
+	case OP_XOR:   x.u ^= s.u; break;
+	case OP_NOT:   x.u = ~x.u; break;
+	case OP_LNOT:  x.i = !x.i; break;
+	case OP_CVTIF: x.f = x.i; break;
+	case OP_CVTFI: 
+		if (!(x.f > -2147483648.0f && x.f < 2147483648.0f)) return 0;
+		x.i = x.f; 
+		break;
+	default: return 0;
+	}
+	*d = x;
+	return 1;
+}
+
+static int is_float_op(int op)
+{
+	return op == OP_FADD || op == OP_FSUB || op == OP_FMUL || op == OP_FDIV || op == OP_CVTIF;
+}
+
+// first live instruction at or after index i, or n
+static int next_live(insn *code, int n, int i)
+{
+	while (i < n && code[i].dead) i++;
+	return i;
+}
+
+static int thread_jumps(insn *code, int n)
+{
+	int changed = 0;
+	for (int i = 0; i < n; i++) {
+		insn *in = &code[i];
+		if (in->dead || !is_jump(in->op)) continue;
+
+		int t = insn_at(code, n, jump_target(in));
+		if (t < 0) continue;
+		t = next_live(code, n, t);
+
+		for (int hops = 0; t < n && code[t].op == OP_J && hops < n; hops++) {
+			int t2 = insn_at(code, n, code[t].a[0]);
+			if (t2 < 0) break;
+			t2 = next_live(code, n, t2);
+			if (t2 == t) break;
+			t = t2;
+		}
+		if (t == n) continue;
+
+		if (t == next_live(code, n, i+1)) {
+			// jump to the next instruction
+			in->dead = 1;
+			changed = 1;
+		} else if (code[t].addr != jump_target(in)) {
+			set_jump_target(in, code[t].addr);
+			changed = 1;
+		}
+	}
+	return changed;
+}
+
+static int remove_unreachable(insn *code, int n)
+{
+	char *seen = calloc(n+1, 1);
+	int *work = malloc(ssizeof(int) * (n+1));
+	if (!seen || !work) die(0, "out of memory");
+
+	int nwork = 0;
+	int first = next_live(code, n, 0);
+	if (first < n) {
+		seen[first] = 1;
+		work[nwork++] = first;
+	}
+	while (nwork) {
+		int i = work[--nwork];
+		int succ[2], nsucc = 0;
+		if (falls_through(code[i].op)) succ[nsucc++] = next_live(code, n, i+1);
+		if (is_jump(code[i].op)) {
+			int t = insn_at(code, n, jump_target(&code[i]));
+			if (t >= 0) succ[nsucc++] = next_live(code, n, t);
+		}
+		for (int k = 0; k < nsucc; k++) {
+			if (succ[k] < n && !seen[succ[k]]) {
+				seen[succ[k]] = 1;
+				work[nwork++] = succ[k];
+			}
+		}
+	}
+
+	int changed = 0;
+	for (int i = 0; i < n; i++) {
+		if (!code[i].dead && !seen[i]) {
+			code[i].dead = 1;
+			changed = 1;
+		}
+	}
+	free(seen);
+	free(work);
+	return changed;
+}
+
+// what the optimizer knows about register and memory values inside a basic block
+typedef struct {
+	int known[EVM_MAXREGS+1];
+	evm_word val[EVM_MAXREGS+1];
+	int npairs;
+	struct { int addr, reg; } pairs[16]; // memory at addr holds the value of reg
+} block_state;
+
+static void forget_reg(block_state *s, int r)
+{
+	s->known[r] = 0;
+	for (int k = 0; k < s->npairs; k++) {
+		if (s->pairs[k].reg == r) s->pairs[k--] = s->pairs[--s->npairs];
+	}
+}
+
+static void forget_addr(block_state *s, int addr)
+{
+	for (int k = 0; k < s->npairs; k++) {
+		if (s->pairs[k].addr == addr) s->pairs[k--] = s->pairs[--s->npairs];
+	}
+}
+
+static int find_pair(block_state *s, int addr)
+{
+	for (int k = 0; k < s->npairs; k++) 
+		if (s->pairs[k].addr == addr) return s->pairs[k].reg;
+	return -1;
+}
+
+static void add_pair(block_state *s, int addr, int reg)
+{
+	forget_addr(s, addr);
+	if (s->npairs == COUNT_ARRAY(s->pairs)) s->npairs--;
+	s->pairs[s->npairs].addr = addr;
+	s->pairs[s->npairs].reg = reg;
+	s->npairs++;
+}
+
+// turn an instruction into a register load of a known value
+static int make_const(block_state *s, insn *in, int r, evm_word v, int isfloat)
+{
+	if (s->known[r] && s->val[r].u == v.u) {
+		in->dead = 1;
+		return 1;
+	}
+	forget_reg(s, r);
+	s->known[r] = 1;
+	s->val[r] = v;
+	if ((in->op == OP_SET || in->op == OP_FSET) && in->a[1] == v.i) return 0;
+	*in = (insn){.op = isfloat ? OP_FSET : OP_SET, .a = {r, v.i}, .addr = in->addr};
+	return 1;
+}
+
+static int propagate_constants(insn *code, int n, char *leader)
+{
+	int changed = 0;
+	block_state s = {0};
+
+	for (int i = 0; i < n; i++) {
+		if (leader[i]) s = (block_state){0};
+		insn *in = &code[i];
+		if (in->dead) continue;
+		int a = in->a[0], b = in->a[1];
+
+		switch (in->op) {
+		case OP_NOP:
+			in->dead = 1;
+			changed = 1;
+			break;
+		case OP_SET:
+		case OP_FSET:
+			changed |= make_const(&s, in, a, (evm_word){.i = b}, in->op == OP_FSET);
+			break;
+		case OP_LDA:
+			changed |= make_const(&s, in, a, (evm_word){.i = b}, 0);
+			break;
+		case OP_CPY:
+			if (a == b) {
+				in->dead = 1;
+				changed = 1;
+			} else if (s.known[b]) {
+				changed |= make_const(&s, in, a, s.val[b], 0);
+			} else {
+				forget_reg(&s, a);
+			}
+			break;
+		case OP_LD: {
+			int r = find_pair(&s, b);
+			if (r == a) {
+				in->dead = 1;
+				changed = 1;
+			} else if (r >= 0 && s.known[r]) {
+				changed |= make_const(&s, in, a, s.val[r], 0);
+				add_pair(&s, b, a);
+			} else if (r >= 0) {
+				*in = (insn){.op = OP_CPY, .a = {a, r}, .addr = in->addr};
+				forget_reg(&s, a);
+				add_pair(&s, b, a);
+				changed = 1;
+			} else {
+				forget_reg(&s, a);
+				add_pair(&s, b, a);
+			}
+			break;
+		}
+		case OP_ST:
+			if (find_pair(&s, a) == b) {
+				// memory already holds this value
+				in->dead = 1;
+				changed = 1;
+			} else {
+				add_pair(&s, a, b);
+			}
+			break;
+		case OP_STD:
+		case OP_PUSH:
+			// may write anywhere in the data segment
+			s.npairs = 0;
+			forget_reg(&s, 0);
+			break;
+		case OP_CAS: case OP_XADD: case OP_ALD: case OP_AST: {
+			// may write anywhere, and other threads' writes become visible
+			regmask defs = insn_defs(in);
+			s.npairs = 0;
+			for (int r = 0; r <= EVM_MAXREGS; r++) 
+				if (defs & REGBIT(r)) forget_reg(&s, r);
+			break;
+		}
+		case OP_SYSCALL:
+			s = (block_state){0};
+			break;
+		case OP_JP: case OP_JPZ: case OP_JZ: case OP_JN: case OP_JNZ:
+			if (s.known[a]) {
+				if (branch_taken(in->op, s.val[a].i)) 
+					*in = (insn){.op = OP_J, .a = {b}, .addr = in->addr};
+				else 
+					in->dead = 1;
+				changed = 1;
+			}
+			break;
+		case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV:
+		case OP_FADD: case OP_FSUB: case OP_FMUL: case OP_FDIV:
+		case OP_AND: case OP_OR: case OP_XOR: {
+			evm_word v = s.val[a];
+			if (s.known[a] && s.known[b] && fold(in->op, &v, s.val[b])) 
+				changed |= make_const(&s, in, a, v, is_float_op(in->op));
+			else 
+				forget_reg(&s, a);
+			break;
+		}
+		case OP_NOT: case OP_LNOT: case OP_CVTFI: case OP_CVTIF: {
+			evm_word v = s.val[a];
+			if (s.known[a] && fold(in->op, &v, v)) 
+				changed |= make_const(&s, in, a, v, is_float_op(in->op));
+			else 
+				forget_reg(&s, a);
+			break;
+		}
+		default: {
+			regmask defs = insn_defs(in);
+			for (int r = 0; r <= EVM_MAXREGS; r++) 
+				if (defs & REGBIT(r)) forget_reg(&s, r);
+			break;
+		}
+		}
+	}
+	return changed;
+}
+
+static int reads_memory(insn *in, int addr)
+{
+	switch (in->op) {
+	case OP_LD:      return in->a[1] == addr;
+	case OP_LDD: 
+	case OP_POP: 
+	case OP_SYSCALL: 
+	case OP_CAS: case OP_XADD: case OP_ALD: case OP_AST: // other threads may read it
+	case OP_TRAP:
+	case OP_STOP:    return 1;
+	default:         return 0;
+	}
+}
+
+static int remove_dead_stores(insn *code, int n, char *leader)
+{
+	int changed = 0;
+
+	// if memory is only ever read by ld, a store to an address that no ld reads is dead
+	int indirect = 0;
+	for (int i = 0; i < n; i++) {
+		int op = code[i].op;
+		if (!code[i].dead && (op == OP_LDD || op == OP_POP || op == OP_SYSCALL || op == OP_CAS || op == OP_XADD || op == OP_ALD)) 
+			indirect = 1;
+	}
+
+	for (int i = 0; i < n; i++) {
+		if (code[i].dead || code[i].op != OP_ST) continue;
+		int addr = code[i].a[0];
+
+		if (!indirect) {
+			int read = 0;
+			for (int k = 0; k < n && !read; k++) 
+				read = !code[k].dead && code[k].op == OP_LD && code[k].a[1] == addr;
+			if (!read) {
+				code[i].dead = 1;
+				changed = 1;
+				continue;
+			}
+		}
+
+		// a store that's overwritten later in the block without being read is dead
+		for (int k = i+1; k < n && !leader[k]; k++) {
+			if (code[k].dead) continue;
+			if (reads_memory(&code[k], addr)) break;
+			if (code[k].op == OP_ST && code[k].a[0] == addr) {
+				code[i].dead = 1;
+				changed = 1;
+				break;
+			}
+		}
+	}
+	return changed;
+}
+
+static int removable(insn *in, int len_data)
+{
+	switch (in->op) {
+	case OP_SET: case OP_FSET: case OP_LDA: case OP_CPY:
+	case OP_ADD: case OP_SUB: case OP_MUL:
+	case OP_FADD: case OP_FSUB: case OP_FMUL: case OP_FDIV:
+	case OP_AND: case OP_OR: case OP_XOR:
+	case OP_NOT: case OP_LNOT: case OP_CVTFI: case OP_CVTIF:
+		return 1;
+	case OP_LD:
+		return in->a[1] >= 0 && in->a[1] < len_data;
+	default:
+		// div and ldd can fault, everything else has side effects
+		return 0;
+	}
+}
+
+static int remove_dead_code(insn *code, int n, int len_data)
+{
+	regmask *live = calloc(n+1, ssizeof(regmask)); // live registers before each instruction
+	if (!live) die(0, "out of memory");
+
+	int again = 1;
+	while (again) {
+		again = 0;
+		for (int i = n-1; i >= 0; i--) {
+			if (code[i].dead) continue;
+			regmask out = 0;
+			if (falls_through(code[i].op)) out |= live[next_live(code, n, i+1)];
+			if (is_jump(code[i].op)) {
+				int t = insn_at(code, n, jump_target(&code[i]));
+				if (t >= 0) out |= live[next_live(code, n, t)];
+			}
+			regmask in = insn_uses(&code[i]) | (out & ~insn_defs(&code[i]));
+			if (in != live[i]) {
+				live[i] = in;
+				again = 1;
+			}
+		}
+	}
+
+	int changed = 0;
+	for (int i = 0; i < n; i++) {
+		if (code[i].dead || !removable(&code[i], len_data)) continue;
+		int nxt = next_live(code, n, i+1);
+		if (!(live[nxt] & REGBIT(code[i].a[0]))) {
+			code[i].dead = 1;
+			changed = 1;
+		}
+	}
+	free(live);
+	return changed;
+}
+
+// returns a malloc'd optimized copy of a (validated) image
+evm_mem *optimize_image(evm_mem *img, const char **err)
+{
+	int n = 0;
+	if (img->version & EVM_SNAPSHOT) {
+		*err = "can't optimize image: it's a snapshot"; // the saved ip would be wrong
+		return 0;
+	}
+
+	insn *code = decode_code(img, &n);
+	if (!code) {
+		*err = "can't optimize image: invalid instruction in code segment";
+		return 0;
+	}
+
+	for (int i = 0; i < n; i++) {
+		for (int k = 0; k < evm_ops[code[i].op].nargs; k++) {
+			int arg = code[i].a[k];
+			int bad = evm_ops[code[i].op].argtypes[k] == EVM_REG && (arg < 0 || arg > evm_numregs(img));
+			if (is_jump(code[i].op) && k == (code[i].op != OP_J)) bad = insn_at(code, n, arg) < 0;
+			if (bad) {
+				free(code);
+				*err = "can't optimize image: invalid register or jump target in code segment";
+				return 0;
+			}
+		}
+	}
+
+	char *leader = malloc(n+1);
+	if (!leader) die(0, "out of memory");
+
+	for (int changed = 1, iter = 0; changed && iter < 100; iter++) {
+		changed = thread_jumps(code, n);
+		changed |= remove_unreachable(code, n);
+		find_leaders(code, n, leader);
+		changed |= propagate_constants(code, n, leader);
+		changed |= remove_dead_stores(code, n, leader);
+		changed |= remove_dead_code(code, n, img->len_data);
+	}
+
+	// lay out the surviving instructions and remap jump targets
+	int *newaddr = malloc(ssizeof(int) * (n+1));
+	if (!newaddr) die(0, "out of memory");
+	int pos = img->len_data;
+	for (int i = 0; i < n; i++) {
+		newaddr[i] = pos;
+		if (!code[i].dead) pos += 1 + evm_ops[code[i].op].nargs;
+	}
+	newaddr[n] = pos;
+
+	evm_mem *out = malloc(ssizeof(*out) + 4LL*pos);
+	if (!out) die(0, "out of memory");
+	*out = *img;
+	out->len_code = pos - img->len_data;
+	memcpy(out->mem, img->mem, 4LL*img->len_data);
+
+	pos = img->len_data;
+	for (int i = 0; i < n; i++) {
+		insn in = code[i];
+		if (in.dead) continue;
+		if (is_jump(in.op)) set_jump_target(&in, newaddr[insn_at(code, n, jump_target(&in))]);
+		out->mem[pos++].i = in.op;
+		for (int k = 0; k < evm_ops[in.op].nargs; k++) 
+			out->mem[pos++].i = in.a[k];
+	}
+
+	free(newaddr);
+	free(leader);
+	free(code);
+	return out;
+}
+
+const char *optimize(int bufsz, unsigned char *buf)
+{
+	evm_mem *img = (evm_mem*)buf;
+	const char *err = validate_evm_mem(bufsz, img);
+	if (err) return err;
+
+	evm_mem *out = optimize_image(img, &err);
+	if (!out) return err;
+
+	fwrite(out, 1, ssizeof(*out) + 4LL*(out->len_data + out->len_code), stdout);
+	free(out);
+	return 0;
+}
+
+/*
+	Syscalls
+
+	r1 holds the syscall code and receives the result, which is negative (minus
+	an errno value) on failure. Buffers are ranges of the data segment or of the
+	heap, given as a word address and a length in bytes; read and write transfer
+	data directly between a file descriptor and the VM's memory.
+*/
+
+enum {
+	SYS_READ  = 1, // r2 = fd, r3 = address, r4 = bytes -> bytes read
+	SYS_WRITE = 2, // r2 = fd, r3 = address, r4 = bytes -> bytes written
+	SYS_OPEN  = 3, // r2 = address of path, r3 = bytes in path, r4 = mode -> fd
+	SYS_CLOSE = 4, // r2 = fd
+	SYS_CLOCK = 5, // r2 = seconds, r3 = nanoseconds (monotonic clock)
+	SYS_SPAWN = 6, // r2 = stack pointer of the new thread -> thread id (0 in the new thread)
+	SYS_JOIN  = 7, // r2 = thread id -> r1 of the thread when it stopped
+	SYS_SNAPSHOT = 8, // -> 0, or 1 when resumed from the snapshot taken here (-S)
+	SYS_ALLOC  = 9,  // r2 = words -> address of a zeroed block of at least that many words
+	SYS_FREE   = 10, // r2 = address of a block
+	SYS_RESIZE = 11, // r2 = address of a block (or 0), r3 = words -> address of the block, moved if needed
+};
+
+// open modes
+enum { OPEN_READ, OPEN_WRITE, OPEN_APPEND, OPEN_READWRITE };
+
+// the bytes at address addr of the data segment or the heap, if len of them fit
+static char *sys_buffer(evm_vm *vm, int addr, int len)
+{
+	int start = vm->start_data, end = vm->end_data;
+	if (vm->heap && addr >= vm->heap->start) start = vm->heap->start, end = vm->heap->end;
+	if (addr < start || len < 0 || addr > end || len > 4LL*(end - addr)) 
+		return 0;
+	return (char*)(vm->memory->mem + addr);
+}
+
+// store the result of a syscall in r1
+static const char *sys_return(evm_vm *vm, long long ret)
+{
+	if (ret == -1) ret = -errno;
+	vm->r->r[1].i = (int)ret;
+	return 0;
+}
+
+static const char *sys_read(evm_vm *vm)
+{
+	char *buf = sys_buffer(vm, vm->r->r[3].i, vm->r->r[4].i);
+	if (!buf) return sys_return(vm, -EFAULT);
+	return sys_return(vm, read(vm->r->r[2].i, buf, vm->r->r[4].i));
+}
+
+static const char *sys_write(evm_vm *vm)
+{
+	char *buf = sys_buffer(vm, vm->r->r[3].i, vm->r->r[4].i);
+	if (!buf) return sys_return(vm, -EFAULT);
+	fflush(stdout); // keep the order with put and fput
+	return sys_return(vm, write(vm->r->r[2].i, buf, vm->r->r[4].i));
+}
+
+static const char *sys_open(evm_vm *vm)
+{
+	static const int open_flags[] = {
+		[OPEN_READ]      = O_RDONLY,
+		[OPEN_WRITE]     = O_WRONLY | O_CREAT | O_TRUNC,
+		[OPEN_APPEND]    = O_WRONLY | O_CREAT | O_APPEND,
+		[OPEN_READWRITE] = O_RDWR | O_CREAT,
+	};
+
+	char path[4096];
+	int len = vm->r->r[3].i, mode = vm->r->r[4].i;
+	char *buf = sys_buffer(vm, vm->r->r[2].i, len);
+	if (!buf) return sys_return(vm, -EFAULT);
+	if (len >= ssizeof(path)) return sys_return(vm, -ENAMETOOLONG);
+	if (mode < 0 || mode >= COUNT_ARRAY(open_flags)) return sys_return(vm, -EINVAL);
+
+	memcpy(path, buf, len);
+	path[len] = 0;
+	return sys_return(vm, open(path, open_flags[mode] | O_CLOEXEC, 0666));
+}
+
+static const char *sys_close(evm_vm *vm)
+{
+	return sys_return(vm, close(vm->r->r[2].i));
+}
+
+static const char *sys_clock(evm_vm *vm)
+{
+	struct timespec t;
+	int ret = clock_gettime(CLOCK_MONOTONIC, &t);
+	vm->r->r[2].i = (int)t.tv_sec;
+	vm->r->r[3].i = (int)t.tv_nsec;
+	return sys_return(vm, ret);
+}
+
+/*
+	Heap (alloc, free, resize)
+
+	The heap is the part of the memory buffer after the image. Blocks are
+	HEAP_GRANULE words times a power of two, and freed blocks of each size are
+	kept in a list for the next allocation of that size; other blocks are cut
+	from the top of the heap. The program may access the heap up to its top
+	(see evm_heap), so accesses to freed blocks aren't caught. The sizes of
+	the blocks are kept on the host, where the program can't overwrite them.
+*/
+
+#define HEAP_GRANULE 4 // words
+#define HEAP_CLASSES 24
+
+typedef struct {
+	evm_heap h;          // first, so that vm->heap points to this
+	int limit;           // the end of the memory buffer
+	signed char *blocks; // for each granule: class+1 at an allocated block, -(class+1) at a freed one
+	int *free[HEAP_CLASSES];
+	int nfree[HEAP_CLASSES], maxfree[HEAP_CLASSES];
+	pthread_mutex_t lock;
+	struct hart_table *threads; // the threads share the arena, so it keeps their table too (see sys_spawn)
+} heap_arena;
+
+static heap_arena *heap_of(evm_vm *vm)
+{
+	if (!vm->heap) {
+		heap_arena *a = calloc(1, sizeof(*a));
+		if (!a) die(0, "out of memory");
+		// after the image, including the registers of a snapshot
+		int start = vm->end_code;
+		if (vm->memory->version & EVM_SNAPSHOT) start += (int)((sizeof(evm_regs) + sizeof(evm_word) - 1) / sizeof(evm_word));
+		a->h.start = a->h.end = start;
+		a->limit = vm->end_memory > start ? vm->end_memory : start;
+		a->blocks = calloc((a->limit - start) / HEAP_GRANULE + 1, 1);
+		if (!a->blocks) die(0, "out of memory");
+		pthread_mutex_init(&a->lock, 0);
+		vm->heap = &a->h;
+	}
+	return (heap_arena*)vm->heap;
+}
+
+static int heap_alloc(heap_arena *a, evm_word *mem, int words)
+{
+	if (words <= 0) return -EINVAL;
+	int k = 0;
+	while (k < HEAP_CLASSES && (HEAP_GRANULE << k) < words) k++;
+	if (k == HEAP_CLASSES) return -ENOMEM;
+	int size = HEAP_GRANULE << k;
+
+	int addr;
+	if (a->nfree[k]) {
+		addr = a->free[k][--a->nfree[k]];
+	} else {
+		if (a->limit - a->h.end < size) return -ENOMEM;
+		addr = a->h.end;
+		__atomic_store_n(&a->h.end, addr + size, __ATOMIC_RELAXED);
+	}
+	a->blocks[(addr - a->h.start) / HEAP_GRANULE] = (signed char)(k + 1);
+	memset(&mem[addr], 0, sizeof(evm_word) * size);
+	return addr;
+}
+
+// the size class of the allocated block at addr, or -1
+static int heap_block(heap_arena *a, int addr)
+{
+	int g = addr - a->h.start;
+	if (addr < a->h.start || addr >= a->h.end || g % HEAP_GRANULE) return -1;
+	return a->blocks[g / HEAP_GRANULE] - 1;
+}
+
+static int heap_free(heap_arena *a, int addr)
+{
+	int k = heap_block(a, addr);
+	if (k < 0) return -EINVAL;
+	a->blocks[(addr - a->h.start) / HEAP_GRANULE] = (signed char)-(k + 1);
+	a->free[k] = grow(a->free[k], &a->maxfree[k], a->nfree[k]+1, ssizeof(int));
+	a->free[k][a->nfree[k]++] = addr;
+	return 0;
+}
+
+static int heap_resize(heap_arena *a, evm_word *mem, int addr, int words)
+{
+	if (!addr) return heap_alloc(a, mem, words);
+	int k = heap_block(a, addr);
+	if (k < 0 || words <= 0) return -EINVAL;
+	int size = HEAP_GRANULE << k;
+	if (words <= size) return addr;
+
+	int moved = heap_alloc(a, mem, words);
+	if (moved < 0) return moved;
+	memcpy(&mem[moved], &mem[addr], sizeof(evm_word) * size);
+	heap_free(a, addr);
+	return moved;
+}
+
+static const char *sys_alloc(evm_vm *vm)
+{
+	heap_arena *a = heap_of(vm);
+	pthread_mutex_lock(&a->lock);
+	int ret = heap_alloc(a, vm->memory->mem, vm->r->r[2].i);
+	pthread_mutex_unlock(&a->lock);
+	return sys_return(vm, ret);
+}
+
+static const char *sys_free(evm_vm *vm)
+{
+	heap_arena *a = heap_of(vm);
+	pthread_mutex_lock(&a->lock);
+	int ret = heap_free(a, vm->r->r[2].i);
+	pthread_mutex_unlock(&a->lock);
+	return sys_return(vm, ret);
+}
+
+static const char *sys_resize(evm_vm *vm)
+{
+	heap_arena *a = heap_of(vm);
+	pthread_mutex_lock(&a->lock);
+	int ret = heap_resize(a, vm->memory->mem, vm->r->r[2].i, vm->r->r[3].i);
+	pthread_mutex_unlock(&a->lock);
+	return sys_return(vm, ret);
+}
+
+/*
+	Threads (harts) run on host threads and share the memory of the program.
+	A new thread starts after the spawn syscall with a copy of the registers
+	of the thread that spawned it, except for r1 (0) and sp. Threads always
+	use the blocking syscalls, as they have a host thread to block. Each
+	program has its own table of threads, and the threads that it didn't join
+	are joined when its heap is released, before its memory can be reused. If
+	the program failed, they are stopped first: threads run in slices, and
+	look at a stop flag between them.
+*/
+
+#define MAX_HARTS 64
+
+typedef struct {
+	pthread_t thread;
+	evm_vm vm;
+	evm_regs start;
+	evm_status status;
+	int used;     // 1: running or stopped, 2: being joined
+	int finished;
+	int notify;   // written when it finishes (see sys_join_async), or -1
+} hart;
+
+typedef struct hart_table {
+	hart harts[MAX_HARTS];
+	pthread_mutex_t lock;
+	int stop; // the program failed: its threads stop at the end of their slice
+} hart_table;
+
+#define HART_SLICE (1<<16) // instructions that a thread runs between looks at the stop flag
+
+static evm_vm host_vm(void *user);
+
+static void *hart_main(void *arg)
+{
+	hart *h = arg;
+	evm_mem *m = h->vm.memory;
+	int size = (int)(ssizeof(*m) + 4LL*(m->len_data + m->len_code));
+	hart_table *tab = heap_of(&h->vm)->threads;
+
+	// in slices, so that a thread left running by a program that failed can be stopped
+	evm_hooks hooks = {.limit = HART_SLICE};
+	evm_regs r = h->start;
+	for (;;) {
+		h->status = evm_run_ex(size, m, &h->vm, &r, EVM_DEFAULT_FLAGS | EVM_HOOKED, &hooks);
+		if (h->status.errmsg || h->status.stop || h->status.retired < HART_SLICE) break;
+		if (__atomic_load_n(&tab->stop, __ATOMIC_RELAXED)) break;
+		r = h->status.r;
+	}
+
+	pthread_mutex_lock(&tab->lock);
+	h->finished = 1;
+	if (h->notify >= 0) {
+		unsigned long long one = 1;
+		if (write(h->notify, &one, sizeof(one)) < 0) {}
+	}
+	pthread_mutex_unlock(&tab->lock);
+	return 0;
+}
+
+static const char *sys_spawn(evm_vm *vm)
+{
+	int sp = vm->r->r[2].i;
+	if (sp < vm->start_data || sp >= vm->end_data) return sys_return(vm, -EINVAL);
+
+	heap_arena *a = heap_of(vm);
+	if (!a->threads) {
+		// only one thread can be running before the first spawn
+		a->threads = calloc(1, sizeof(*a->threads));
+		if (!a->threads) die(0, "out of memory");
+		pthread_mutex_init(&a->threads->lock, 0);
+	}
+	hart_table *tab = a->threads;
+	pthread_mutex_lock(&tab->lock);
+	int id = 0;
+	while (id < MAX_HARTS && tab->harts[id].used) id++;
+	if (id < MAX_HARTS) tab->harts[id].used = 1;
+	pthread_mutex_unlock(&tab->lock);
+	if (id == MAX_HARTS) return sys_return(vm, -EAGAIN);
+
+	hart *h = &tab->harts[id];
+	h->vm = host_vm(0);
+	h->vm.memory = vm->memory;
+	h->vm.heap = &a->h;
+	h->vm.out = vm->out;
+	h->start = *vm->r;
+	h->start.ip += 1;
+	h->start.sp = sp;
+	h->start.r[1].i = 0;
+	h->finished = 0;
+	h->notify = -1;
+
+	int err = pthread_create(&h->thread, 0, hart_main, h);
+	if (err) {
+		h->used = 0;
+		return sys_return(vm, -err);
+	}
+	return sys_return(vm, id + 1);
+}
+
+// the thread with the given id (from spawn), marked as being joined, or 0
+static hart *hart_claim(hart_table *tab, int id)
+{
+	if (!tab || id < 1 || id > MAX_HARTS) return 0;
+	pthread_mutex_lock(&tab->lock);
+	hart *h = &tab->harts[id-1];
+	if (h->used == 1) h->used = 2;
+	else h = 0;
+	pthread_mutex_unlock(&tab->lock);
+	return h;
+}
+
+static evm_status hart_join(hart *h)
+{
+	pthread_join(h->thread, 0);
+	if (h->notify >= 0) close(h->notify);
+	h->notify = -1;
+	evm_status s = h->status;
+	h->used = 0;
+	return s;
+}
+
+static const char *sys_join(evm_vm *vm)
+{
+	hart *h = hart_claim(heap_of(vm)->threads, vm->r->r[2].i);
+	if (!h) return sys_return(vm, -ESRCH);
+
+	evm_status s = hart_join(h);
+	if (s.errmsg) return s.errmsg; // a thread failed, so does the program
+	return sys_return(vm, s.r.r[1].i);
+}
+
+// failed: the program failed, so the threads that it left running are stopped rather than waited for
+static void heap_release(evm_vm *vm, int failed)
+{
+	heap_arena *a = (heap_arena*)vm->heap;
+	if (!a) return;
+
+	// join the threads that the program left running (they may spawn more
+	// or join each other in the meantime, so until none is left)
+	if (a->threads && failed) __atomic_store_n(&a->threads->stop, 1, __ATOMIC_RELAXED);
+	for (hart_table *tab = a->threads; tab; ) {
+		hart *h = 0;
+		for (int id = 1; id <= MAX_HARTS && !h; id++) h = hart_claim(tab, id);
+		if (!h) {
+			pthread_mutex_destroy(&tab->lock);
+			free(tab);
+			break;
+		}
+		int id = (int)(h - tab->harts) + 1;
+		evm_status s = hart_join(h);
+		if (s.errmsg) {
+			fflush(stdout);
+			fprintf(stderr, "thread %i, which wasn't joined, failed at ip %i: %s\n", id, s.r.ip, s.errmsg);
+		}
+	}
+
+	for (int k = 0; k < HEAP_CLASSES; k++) free(a->free[k]);
+	free(a->blocks);
+	pthread_mutex_destroy(&a->lock);
+	free(a);
+	vm->heap = 0;
+}
+
+// a snapshot is only taken with -S (see take_snapshot)
+static const char *sys_snapshot(evm_vm *vm)
+{
+	return sys_return(vm, 0);
+}
+
+static const evm_native host_natives[] = {
+	[SYS_READ]  = sys_read,
+	[SYS_WRITE] = sys_write,
+	[SYS_OPEN]  = sys_open,
+	[SYS_CLOSE] = sys_close,
+	[SYS_CLOCK] = sys_clock,
+	[SYS_SPAWN] = sys_spawn,
+	[SYS_JOIN]  = sys_join,
+	[SYS_SNAPSHOT] = sys_snapshot,
+	[SYS_ALLOC]  = sys_alloc,
+	[SYS_FREE]   = sys_free,
+	[SYS_RESIZE] = sys_resize,
+};
+
+// a context for running a program with the host's syscalls
+static evm_vm host_vm(void *user)
+{
+	return (evm_vm){.user = user, .natives = host_natives, .nnatives = COUNT_ARRAY(host_natives)};
+}
+
+/*
+	Profiler (-p)
+
+	Runs a program with per-instruction counters (kept by the hooked variant of
+	the interpreter in arrays indexed by code address) and prints a report to
+	stderr when it finishes: executions per opcode, the hottest basic blocks
+	and loops, and the disassembly with execution and branch counts.
+*/
+
+typedef struct {
+	int first, last; // instruction indices
+	unsigned long long executed;
+} prof_block;
+
+typedef struct {
+	int header, backedge; // code addresses
+	unsigned long long iterations;
+} prof_loop;
+
+typedef struct {
+	int op;
+	unsigned long long count;
+} prof_op;
+
+static int cmp_block(const void *a, const void *b)
+{
+	unsigned long long x = ((prof_block*)a)->executed, y = ((prof_block*)b)->executed;
+	return (x < y) - (x > y);
+}
+
+static int cmp_loop(const void *a, const void *b)
+{
+	unsigned long long x = ((prof_loop*)a)->iterations, y = ((prof_loop*)b)->iterations;
+	return (x < y) - (x > y);
+}
+
+static int cmp_op(const void *a, const void *b)
+{
+	unsigned long long x = ((prof_op*)a)->count, y = ((prof_op*)b)->count;
+	return (x < y) - (x > y);
+}
+
+static double percent(unsigned long long x, unsigned long long total)
+{
+	return total ? 100.0 * x / total : 0;
+}
+
+void print_profile(FILE *out, evm_mem *img, unsigned long long *counts, unsigned long long *taken)
+{
+	int n = 0;
+	insn *code = decode_code(img, &n);
+	if (!code) {
+		fprintf(out, "can't annotate profile: invalid instruction in code segment\n");
+		return;
+	}
+	int start_code = img->len_data;
+
+	unsigned long long total = 0;
+	prof_op ops[OP_INVAL] = {0};
+	for (int i = 0; i < OP_INVAL; i++) ops[i].op = i;
+	for (int i = 0; i < n; i++) {
+		unsigned long long c = counts[code[i].addr - start_code];
+		ops[code[i].op].count += c;
+		total += c;
+	}
+
+	fprintf(out, "--- PROFILE --------------------------------------\n");
+	fprintf(out, "%llu instructions executed\n", total);
+
+	fprintf(out, "--- OPCODES --------------------------------------\n");
+	fprintf(out, "       count       %%   opcode\n");
+	qsort(ops, OP_INVAL, sizeof(ops[0]), cmp_op);
+	for (int i = 0; i < OP_INVAL && ops[i].count; i++) 
+		fprintf(out, "%12llu  %5.1f%%   %s\n", ops[i].count, percent(ops[i].count, total), evm_ops[ops[i].op].str);
+
+	char *leader = malloc(n+1);
+	prof_block *blocks = malloc(ssizeof(prof_block) * (n+1));
+	prof_loop *loops = malloc(ssizeof(prof_loop) * (n+1));
+	if (!leader || !blocks || !loops) die(0, "out of memory");
+
+	find_leaders(code, n, leader);
+	int nblocks = 0, nloops = 0;
+	for (int i = 0; i < n; i++) {
+		if (leader[i]) blocks[nblocks++] = (prof_block){.first = i};
+		blocks[nblocks-1].last = i;
+		blocks[nblocks-1].executed += counts[code[i].addr - start_code];
+
+		// a jump backwards closes a loop
+		if (is_jump(code[i].op) && jump_target(&code[i]) <= code[i].addr) {
+			loops[nloops++] = (prof_loop){
+				.header = jump_target(&code[i]),
+				.backedge = code[i].addr,
+				.iterations = taken[code[i].addr - start_code],
+			};
+		}
+	}
+
+	fprintf(out, "--- HOT BLOCKS -----------------------------------\n");
+	fprintf(out, "    executed       %%   first      last       instructions\n");
+	qsort(blocks, nblocks, sizeof(blocks[0]), cmp_block);
+	for (int i = 0; i < nblocks && i < 10 && blocks[i].executed; i++) {
+		prof_block b = blocks[i];
+		char where[256] = {0};
+		int len = 0;
+		source_location(where, ssizeof(where), &len, code[b.first].addr);
+		fprintf(out, "%12llu  %5.1f%%   %.8x   %.8x   %-12i%s\n", b.executed, percent(b.executed, total), 
+			code[b.first].addr, code[b.last].addr, b.last - b.first + 1, where);
+	}
+
+	if (nloops) {
+		fprintf(out, "--- LOOPS ----------------------------------------\n");
+		fprintf(out, "  iterations   header     back edge\n");
+		qsort(loops, nloops, sizeof(loops[0]), cmp_loop);
+		for (int i = 0; i < nloops; i++) {
+			char where[256] = {0};
+			int len = 0;
+			source_location(where, ssizeof(where), &len, loops[i].header);
+			fprintf(out, "%12llu   %.8x   %.8x%s\n", loops[i].iterations, loops[i].header, loops[i].backedge, where);
+		}
+	}
+
+	fprintf(out, "--- CODE SECTION ---------------------------------\n");
+	fprintf(out, "       count       taken   not taken   \n");
+	for (int i = 0; i < n; i++) {
+		char line[256];
+		int a = code[i].addr - start_code;
+		disasm_insn(line, ssizeof(line), img->mem, code[i].addr, ' ');
+		print_labels(out, code[i].addr);
+
+		if (is_jump(code[i].op)) 
+			fprintf(out, "%12llu %11llu %11llu   %s\n", counts[a], taken[a], counts[a] - taken[a], line);
+		else 
+			fprintf(out, "%12llu                           %s\n", counts[a], line);
+	}
+
+	free(loops);
+	free(blocks);
+	free(leader);
+	free(code);
+}
+
+void report_error(evm_status s)
+{
+	fprintf(stderr, "%s\n", s.errmsg);
+	char where[256] = {0};
+	int len = 0;
+	source_location(where, ssizeof(where), &len, s.r.ip);
+	fprintf(stderr, "\tip  %i%s\n", s.r.ip, where);
+	fprintf(stderr, "\tsp  %i\n", s.r.sp);
+	for(int i = 1; i <= (s.nregs ? s.nregs : EVM_NUMREGS); i++) 
+		fprintf(stderr, "\tr%i  %i (%x) (%f)\n", i, s.r.r[i].i, s.r.r[i].u, s.r.r[i].f);
+}
+
+const char *profile(int bufsz, unsigned char *buf)
+{
+	evm_mem *img = (evm_mem*)buf;
+	const char *err = validate_evm_mem(bufsz, img);
+	if (err) return err;
+
+	unsigned long long *counts = calloc(img->len_code + 1, sizeof(*counts));
+	unsigned long long *taken  = calloc(img->len_code + 1, sizeof(*taken));
+	if (!counts || !taken) die(0, "out of memory");
+
+	evm_hooks hooks = {.counts = counts, .taken = taken};
+	evm_vm vm = host_vm(0);
+	evm_status s = evm_run_ex(bufsz, img, &vm, evm_snapshot_regs(bufsz, img), EVM_DEFAULT_FLAGS | EVM_HOOKED, &hooks);
+	heap_release(&vm, s.errmsg != 0);
+	fflush(stdout);
+
+	print_profile(stderr, img, counts, taken);
+	free(counts);
+	free(taken);
+
+	if (s.errmsg) {
+		report_error(s);
+		exit(EXIT_FAILURE);
+	}
+	return 0;
+}
+
+/*
+	Sampling profiler (-s)
+
+	A SIGPROF interval timer interrupts the program about every millisecond of
+	CPU time. The handler reads the ip that the interpreter publishes (only the
+	EVM_PUBLISH variant does this, at the cost of one store per instruction) and
+	appends it to a ring buffer. After the run, the samples are aggregated into
+	a histogram of hot addresses.
+*/
+
+#define SAMPLE_RING (1<<20)
+#define SAMPLE_INTERVAL_US 1000
+
+static volatile int sample_ip = -1;
+static int sample_ring[SAMPLE_RING];
+static unsigned sample_head, sample_tail;
+static unsigned long long sample_dropped;
+
+static void sample_handler(int sig)
+{
+	(void)sig;
+	unsigned head = __atomic_load_n(&sample_head, __ATOMIC_RELAXED);
+	unsigned tail = __atomic_load_n(&sample_tail, __ATOMIC_ACQUIRE);
+	if (head - tail >= SAMPLE_RING) {
+		sample_dropped++;
+		return;
+	}
+	sample_ring[head % SAMPLE_RING] = sample_ip;
+	__atomic_store_n(&sample_head, head+1, __ATOMIC_RELEASE);
+}
+
+static void sample_timer(int on)
+{
+	struct itimerval t = {0};
+	if (on) {
+		t.it_interval.tv_usec = SAMPLE_INTERVAL_US;
+		t.it_value.tv_usec = SAMPLE_INTERVAL_US;
+	}
+	setitimer(ITIMER_PROF, &t, 0);
+}
+
+typedef struct {
+	int ip;
+	unsigned long long count;
+} sample_bin;
+
+static int cmp_sample(const void *a, const void *b)
+{
+	unsigned long long x = ((sample_bin*)a)->count, y = ((sample_bin*)b)->count;
+	return (x < y) - (x > y);
+}
+
+const char *sample(int bufsz, unsigned char *buf)
+{
+	evm_mem *img = (evm_mem*)buf;
+	const char *err = validate_evm_mem(bufsz, img);
+	if (err) return err;
+
+	sample_bin *bins = calloc(img->len_code + 1, sizeof(*bins));
+	if (!bins) die(0, "out of memory");
+
+	struct sigaction sa = {.sa_handler = sample_handler, .sa_flags = SA_RESTART};
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGPROF, &sa, 0);
+
+	evm_hooks hooks = {.ip_out = &sample_ip};
+	sample_timer(1);
+	evm_vm vm = host_vm(0);
+	evm_status s = evm_run_ex(bufsz, img, &vm, evm_snapshot_regs(bufsz, img), EVM_DEFAULT_FLAGS | EVM_PUBLISH, &hooks);
+	heap_release(&vm, s.errmsg != 0);
+	sample_timer(0);
+	signal(SIGPROF, SIG_IGN);
+	fflush(stdout);
+
+	// drain the ring buffer
+	int start_code = img->len_data;
+	unsigned long long total = 0;
+	unsigned head = __atomic_load_n(&sample_head, __ATOMIC_ACQUIRE);
+	for (; sample_tail != head; sample_tail++) {
+		int ip = sample_ring[sample_tail % SAMPLE_RING];
+		if (ip < start_code || ip >= start_code + img->len_code) continue;
+		bins[ip - start_code].ip = ip;
+		bins[ip - start_code].count++;
+		total++;
+	}
+	qsort(bins, img->len_code, sizeof(*bins), cmp_sample);
+
+	fprintf(stderr, "--- SAMPLES --------------------------------------\n");
+	fprintf(stderr, "%llu samples at %i us intervals, %llu dropped\n", total, SAMPLE_INTERVAL_US, sample_dropped);
+	fprintf(stderr, "     samples       %%\n");
+	for (int i = 0; i < img->len_code && bins[i].count; i++) {
+		char line[256];
+		int len = disasm_insn(line, ssizeof(line), img->mem, bins[i].ip, ' ') ? (int)strlen(line) : 0;
+		source_location(line, ssizeof(line), &len, bins[i].ip);
+		fprintf(stderr, "%12llu  %5.1f%%   %s\n", bins[i].count, percent(bins[i].count, total), line);
+	}
+	free(bins);
+
+	if (s.errmsg) {
+		report_error(s);
+		exit(EXIT_FAILURE);
+	}
+	return 0;
+}
+
+// sends stdout to /dev/null and returns the saved descriptor, or puts it back (saved >= 0)
+static int quiet_stdout(int saved)
+{
+	fflush(stdout);
+	if (saved >= 0) {
+		dup2(saved, STDOUT_FILENO);
+		close(saved);
+		return -1;
+	}
+	saved = dup(STDOUT_FILENO);
+	int null = open("/dev/null", O_WRONLY);
+	if (null >= 0) {
+		dup2(null, STDOUT_FILENO);
+		close(null);
+	}
+	return saved;
+}
+
+/*
+	Hardware performance counters (-perf)
+
+	Counts host cycles, instructions, branch mispredictions and L1 data cache
+	misses around evm_run, and divides them by the number of VM instructions
+	executed. The counters are opened as one group, so that they count the
+	same stretch of the run when the kernel has to multiplex them; the counts
+	are then scaled by the time the group was enabled over the time it ran.
+	They are taken on the plain interpreter loop. The first available of
+	cycles or task-clock is sampled on overflow in a second run, of the
+	variant that publishes the ip (with its output discarded and no input):
+	the signal handler reads the ip, to attribute host time to VM opcodes.
+	Events that the kernel or the hardware doesn't provide are reported as
+	unavailable.
+*/
+
+#ifdef __linux__
+
+typedef struct {
+	const char *name;
+	unsigned type;
+	unsigned long long config;
+	int fd;
+	int err;
+	unsigned long long value;
+} perf_counter;
+
+#define PERF_SAMPLE_PERIOD_CYCLES 200000
+#define PERF_SAMPLE_PERIOD_NS 100000
+
+static int perf_sample_fd = -1;
+static evm_word *perf_mem;
+static unsigned long long perf_op_samples[OP_INVAL+1];
+
+static void perf_sample_handler(int sig)
+{
+	(void)sig;
+	int ip = sample_ip;
+	int op = ip >= 0 ? perf_mem[ip].i : OP_INVAL;
+	perf_op_samples[op >= 0 && op < OP_INVAL ? op : OP_INVAL]++;
+	ioctl(perf_sample_fd, PERF_EVENT_IOC_REFRESH, 1);
+}
+
+// a counter in the group of leader (or the leader of a new group, if -1), or a sampling event
+static int perf_open(perf_counter *c, unsigned long long sample_period, int leader)
+{
+	struct perf_event_attr a = {0};
+	a.size = sizeof(a);
+	a.type = c->type;
+	a.config = c->config;
+	a.disabled = leader < 0; // the others start with the leader
+	a.exclude_kernel = 1;
+	a.exclude_hv = 1;
+	a.sample_period = sample_period;
+	a.wakeup_events = sample_period ? 1 : 0;
+	if (!sample_period) a.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	return syscall(__NR_perf_event_open, &a, 0, -1, leader, 0);
+}
+
+const char *perf(int bufsz, unsigned char *buf)
+{
+	evm_mem *img = (evm_mem*)buf;
+	const char *err = validate_evm_mem(bufsz, img);
+	if (err) return err;
+
+	perf_counter counters[] = {
+		{.name = "cycles",          .type = PERF_TYPE_HARDWARE, .config = PERF_COUNT_HW_CPU_CYCLES,           .fd = -1},
+		{.name = "instructions",    .type = PERF_TYPE_HARDWARE, .config = PERF_COUNT_HW_INSTRUCTIONS,         .fd = -1},
+		{.name = "branches",        .type = PERF_TYPE_HARDWARE, .config = PERF_COUNT_HW_BRANCH_INSTRUCTIONS,  .fd = -1},
+		{.name = "branch-misses",   .type = PERF_TYPE_HARDWARE, .config = PERF_COUNT_HW_BRANCH_MISSES,        .fd = -1},
+		{.name = "L1d-read-misses", .type = PERF_TYPE_HW_CACHE, .config = PERF_COUNT_HW_CACHE_L1D | 
+			PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16, .fd = -1},
+		{.name = "task-clock (ns)", .type = PERF_TYPE_SOFTWARE, .config = PERF_COUNT_SW_TASK_CLOCK,           .fd = -1},
+	};
+	int ncounters = COUNT_ARRAY(counters);
+
+	// the first counter that opens leads the group
+	int leader = -1, ngroup = 0;
+	for (int i = 0; i < ncounters; i++) {
+		counters[i].fd = perf_open(&counters[i], 0, leader);
+		counters[i].err = counters[i].fd < 0 ? errno : 0;
+		if (counters[i].fd < 0) continue;
+		if (leader < 0) leader = counters[i].fd;
+		ngroup++;
+	}
+
+	// the second run starts from a copy of the image
+	evm_mem *copy = calloc(1, bufsz);
+	if (!copy) die(0, "out of memory");
+	long image = ssizeof(evm_mem) + ssizeof(evm_word) * (img->len_data + img->len_code) + ssizeof(evm_regs);
+	memcpy(copy, img, image < bufsz ? image : bufsz);
+
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (leader >= 0) ioctl(leader, PERF_EVENT_IOC_ENABLE, 0);
+
+	evm_vm vm = host_vm(0);
+	evm_status s = evm_run_ex(bufsz, img, &vm, evm_snapshot_regs(bufsz, img), EVM_DEFAULT_FLAGS, 0);
+
+	if (leader >= 0) ioctl(leader, PERF_EVENT_IOC_DISABLE, 0);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	heap_release(&vm, s.errmsg != 0);
+	fflush(stdout);
+
+	// read the group: nr, time enabled, time running, then the values in the order they were opened
+	unsigned long long group[3 + COUNT_ARRAY(counters)] = {0};
+	if (leader >= 0 && read(leader, group, sizeof(group)) < (ssize_t)sizeof(group[0]) * (3 + ngroup)) 
+		memset(group, 0, sizeof(group));
+	unsigned long long enabled = group[1], running = group[2];
+	for (int i = 0, k = 0; i < ncounters; i++) {
+		if (counters[i].fd < 0) continue;
+		unsigned long long v = group[3 + k++];
+		counters[i].value = running ? (unsigned long long)((double)v * enabled / running) : 0;
+	}
+	for (int i = 0; i < ncounters; i++) 
+		if (counters[i].fd >= 0 && counters[i].fd != leader) close(counters[i].fd);
+	if (leader >= 0) close(leader);
+
+	double wall = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+	double n = s.retired ? (double)s.retired : 1;
+
+	fprintf(stderr, "--- PERFORMANCE COUNTERS -------------------------\n");
+	fprintf(stderr, "%lld VM instructions in %.6f s (%.1f M/s)\n", s.retired, wall, wall > 0 ? s.retired / wall * 1e-6 : 0);
+	if (leader >= 0 && !running) 
+		fprintf(stderr, "the counters never ran (too many for the hardware at once?)\n");
+	else if (running < enabled) 
+		fprintf(stderr, "the counters ran %.1f%% of the time; the counts are scaled\n", percent(running, enabled));
+	fprintf(stderr, "           event               total   per VM instruction\n");
+	for (int i = 0; i < ncounters; i++) {
+		perf_counter *c = &counters[i];
+		if (c->fd < 0) {
+			fprintf(stderr, "%16s   not available (%s)\n", c->name, strerror(c->err));
+			continue;
+		}
+		fprintf(stderr, "%16s %19llu   %10.3f\n", c->name, c->value, c->value / n);
+	}
+
+	// sampling event for the per-opcode breakdown
+	perf_counter sampler[] = {
+		{.name = "cycles",     .type = PERF_TYPE_HARDWARE, .config = PERF_COUNT_HW_CPU_CYCLES, .fd = -1},
+		{.name = "task-clock", .type = PERF_TYPE_SOFTWARE, .config = PERF_COUNT_SW_TASK_CLOCK, .fd = -1},
+	};
+	unsigned long long periods[] = {PERF_SAMPLE_PERIOD_CYCLES, PERF_SAMPLE_PERIOD_NS};
+	const char *sampled = 0;
+	for (int i = 0; i < COUNT_ARRAY(sampler) && perf_sample_fd < 0; i++) {
+		perf_sample_fd = perf_open(&sampler[i], periods[i], -1);
+		if (perf_sample_fd >= 0) sampled = sampler[i].name;
+	}
+	if (perf_sample_fd >= 0) {
+		struct sigaction sa = {.sa_handler = perf_sample_handler, .sa_flags = SA_RESTART};
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGIO, &sa, 0);
+		fcntl(perf_sample_fd, F_SETFL, O_ASYNC);
+		fcntl(perf_sample_fd, F_SETSIG, SIGIO);
+		fcntl(perf_sample_fd, F_SETOWN, getpid());
+		perf_mem = copy->mem;
+
+		// the program already printed its output and read its input
+		int saved_out = quiet_stdout(-1), saved_in = dup(STDIN_FILENO);
+		int null = open("/dev/null", O_RDONLY);
+		if (null >= 0) dup2(null, STDIN_FILENO), close(null);
+
+		evm_hooks hooks = {.ip_out = &sample_ip};
+		evm_vm vm = host_vm(0);
+		ioctl(perf_sample_fd, PERF_EVENT_IOC_REFRESH, 1);
+		evm_status s = evm_run_ex(bufsz, copy, &vm, evm_snapshot_regs(bufsz, copy), EVM_DEFAULT_FLAGS | EVM_PUBLISH, &hooks);
+		ioctl(perf_sample_fd, PERF_EVENT_IOC_DISABLE, 0);
+		heap_release(&vm, s.errmsg != 0);
+
+		quiet_stdout(saved_out);
+		if (saved_in >= 0) dup2(saved_in, STDIN_FILENO), close(saved_in);
+		signal(SIGIO, SIG_IGN);
+		close(perf_sample_fd);
+
+		unsigned long long total = 0;
+		for (int i = 0; i <= OP_INVAL; i++) total += perf_op_samples[i];
+		fprintf(stderr, "--- %s BY OPCODE (%llu samples) ---\n", sampled, total);
+		prof_op ops[OP_INVAL] = {0};
+		for (int i = 0; i < OP_INVAL; i++) ops[i] = (prof_op){.op = i, .count = perf_op_samples[i]};
+		qsort(ops, OP_INVAL, sizeof(ops[0]), cmp_op);
+		for (int i = 0; i < OP_INVAL && ops[i].count; i++) 
+			fprintf(stderr, "%12llu  %5.1f%%   %s\n", ops[i].count, percent(ops[i].count, total), evm_ops[ops[i].op].str);
+	} else {
+		fprintf(stderr, "per-opcode sampling not available\n");
+	}
+	free(copy);
+
+	if (s.errmsg) {
+		report_error(s);
+		exit(EXIT_FAILURE);
+	}
+	return 0;
+}
+
+#else
+
+const char *perf(int bufsz, unsigned char *buf)
+{
+	(void)bufsz; (void)buf;
+	return "performance counters are only supported on Linux";
+}
+
+#endif
+
+/*
+	Run metrics (-metrics FILE)
+
+	Every executed image adds one record: instructions, syscalls, output bytes,
+	wall and CPU time, and how it ended. If FILE ends in .prom, the totals and
+	a histogram of run times are written in the Prometheus text format when
+	the process exits. Otherwise each run is appended to FILE as one line of
+	JSON, followed by a summary line with the histogram if more than one image
+	was executed. Nothing is measured inside the interpreter loop itself.
+*/
+
+static const double metrics_buckets[] = {1e-5, 1e-4, 1e-3, 1e-2, 1e-1, 1, 10};
+#define METRICS_NBUCKETS COUNT_ARRAY(metrics_buckets)
+
+typedef struct {
+	const char *path;
+	int prom;
+	FILE *jsonl;
+	unsigned long long runs, failures;
+	unsigned long long retired, syscalls, out_bytes;
+	double wall, cpu;
+	unsigned long long hist[METRICS_NBUCKETS + 1]; // runs per wall time bucket, last one is +Inf
+} run_metrics;
+
+static double seconds(clockid_t clock)
+{
+	struct timespec t;
+	clock_gettime(clock, &t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static void json_string(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; s && *s; s++) {
+		if (*s == '"' || *s == '\\') fprintf(f, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20) fprintf(f, "\\u%.4x", *s);
+		else fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+void metrics_open(run_metrics *m, const char *path)
+{
+	int len = strlen(path);
+	*m = (run_metrics){.path = path, .prom = len > 5 && !strcmp(path + len - 5, ".prom")};
+	if (!m->prom) {
+		m->jsonl = fopen(path, "a");
+		if (!m->jsonl) die(0, "couldn't open metrics file %s", path);
+	}
+}
+
+void metrics_record(run_metrics *m, const char *image, evm_status s, double wall, double cpu)
+{
+	if (!m->path) return;
+
+	m->runs++;
+	m->failures += !!s.errmsg;
+	m->retired += s.retired;
+	m->syscalls += s.syscalls;
+	m->out_bytes += s.out_bytes;
+	m->wall += wall;
+	m->cpu += cpu;
+
+	int b = 0;
+	while (b < METRICS_NBUCKETS && wall > metrics_buckets[b]) b++;
+	m->hist[b]++;
+
+	if (m->jsonl) {
+		FILE *f = m->jsonl;
+		fprintf(f, "{\"image\":");
+		json_string(f, image);
+		fprintf(f, ",\"instructions\":%lld,\"syscalls\":%lld,\"output_bytes\":%lld", s.retired, s.syscalls, s.out_bytes);
+		fprintf(f, ",\"wall_seconds\":%.9f,\"cpu_seconds\":%.9f", wall, cpu);
+		fprintf(f, ",\"status\":\"%s\",\"errmsg\":", s.errmsg ? "error" : "ok");
+		if (s.errmsg) json_string(f, s.errmsg);
+		else fprintf(f, "null");
+		fprintf(f, ",\"ip\":%i}\n", s.r.ip);
+		fflush(f);
+	}
+}
+
+void metrics_close(run_metrics *m)
+{
+	if (!m->path) return;
+
+	if (m->jsonl) {
+		if (m->runs > 1) {
+			FILE *f = m->jsonl;
+			fprintf(f, "{\"summary\":{\"runs\":%llu,\"failures\":%llu,\"instructions\":%llu,\"wall_seconds\":%.9f,\"cpu_seconds\":%.9f,\"histogram\":{", 
+				m->runs, m->failures, m->retired, m->wall, m->cpu);
+			for (int b = 0; b < METRICS_NBUCKETS; b++) 
+				fprintf(f, "\"%g\":%llu,", metrics_buckets[b], m->hist[b]);
+			fprintf(f, "\"+Inf\":%llu}}}\n", m->hist[METRICS_NBUCKETS]);
+		}
+		fclose(m->jsonl);
+		m->jsonl = 0;
+		return;
+	}
+
+	FILE *f = fopen(m->path, "w");
+	if (!f) die(0, "couldn't open metrics file %s", m->path);
+	fprintf(f, "# TYPE evm_runs_total counter\n");
+	fprintf(f, "evm_runs_total{status=\"ok\"} %llu\n", m->runs - m->failures);
+	fprintf(f, "evm_runs_total{status=\"error\"} %llu\n", m->failures);
+	fprintf(f, "# TYPE evm_instructions_total counter\nevm_instructions_total %llu\n", m->retired);
+	fprintf(f, "# TYPE evm_syscalls_total counter\nevm_syscalls_total %llu\n", m->syscalls);
+	fprintf(f, "# TYPE evm_output_bytes_total counter\nevm_output_bytes_total %llu\n", m->out_bytes);
+	fprintf(f, "# TYPE evm_cpu_seconds_total counter\nevm_cpu_seconds_total %.9f\n", m->cpu);
+	fprintf(f, "# TYPE evm_run_duration_seconds histogram\n");
+	unsigned long long cum = 0;
+	for (int b = 0; b < METRICS_NBUCKETS; b++) {
+		cum += m->hist[b];
+		fprintf(f, "evm_run_duration_seconds_bucket{le=\"%g\"} %llu\n", metrics_buckets[b], cum);
+	}
+	fprintf(f, "evm_run_duration_seconds_bucket{le=\"+Inf\"} %llu\n", m->runs);
+	fprintf(f, "evm_run_duration_seconds_sum %.9f\n", m->wall);
+	fprintf(f, "evm_run_duration_seconds_count %llu\n", m->runs);
+	fclose(f);
+}
+
+enum { MEM_READ = 1, MEM_WRITE = 2 };
+
+// the data address that the instruction at r->ip is about to read or write, if any
+static int insn_mem_access(evm_word *mem, const evm_regs *r, int *addr)
+{
+	int op = mem[r->ip].i;
+	int a1 = mem[r->ip+1].i;
+	int a2 = mem[r->ip+2].i;
+
+	switch (op) {
+	case OP_LD:   *addr = a2;         return MEM_READ;
+	case OP_ST:   *addr = a1;         return MEM_WRITE;
+	case OP_PUSH: *addr = r->sp;      return MEM_WRITE;
+	case OP_POP:  *addr = r->sp + 1;  return MEM_READ;
+	case OP_LDD: case OP_ALD:
+		if (a2 < 0 || a2 > EVM_MAXREGS) return 0;
+		*addr = r->r[a2].i;
+		return MEM_READ;
+	case OP_STD: case OP_AST:
+		if (a1 < 0 || a1 > EVM_MAXREGS) return 0;
+		*addr = r->r[a1].i;
+		return MEM_WRITE;
+	case OP_CAS: case OP_XADD:
+		if (a1 < 0 || a1 > EVM_MAXREGS) return 0;
+		*addr = r->r[a1].i;
+		return MEM_READ | MEM_WRITE;
+	default:
+		return 0;
+	}
+}
+
+/*
+	Interactive debugger (-i)
+
+	Shows a window of the disassembly around ip, the registers, a few words of
+	memory and the last lines of the program's output, which is kept in a
+	buffer (and printed when the debugger quits) rather than written over the
+	screen. Only the lines of the screen that changed are redrawn.
+	Breakpoints replace the opcode at their address with a trap instruction,
+	so the program runs at full speed between them; to continue from a
+	breakpoint, the original instruction is executed on its own first.
+
+	To go backwards, the program runs in pieces of DBG_INTERVAL instructions
+	(the hooks' limit), and the debugger saves the registers in a checkpoint
+	before each; the interpreter calls it before each write to memory, to log
+	the old value of the word. Going back to instruction n undoes the log down
+	to the last checkpoint before n, and executes forward from there (with the
+	output discarded). The oldest checkpoints are dropped when the log or the
+	checkpoint list is full. Syscalls can't be undone, so the history starts
+	over after each one: they end the piece early.
+*/
+
+#define DBG_WINDOW 21   // lines of disassembly
+#define DBG_MEMORY 8    // words of memory
+#define DBG_OUTPUT 6    // lines of the program's output
+#define DBG_ROWS (DBG_WINDOW + DBG_MEMORY + DBG_OUTPUT + EVM_MAXREGS + 9) // at most
+#define DBG_COLS 160
+#define MAX_BREAKPOINTS 64
+#define DBG_INTERVAL 4096        // instructions between checkpoints
+#define DBG_CHECKPOINTS 1024     // at most, so the history is up to 4M instructions
+#define DBG_UNDO (1<<20)         // logged memory writes, at most
+
+typedef struct {
+	int addr;
+	int op; // the opcode that the trap replaced
+} breakpoint;
+
+typedef struct {
+	evm_regs r;
+	unsigned long long icount; // instructions executed before it
+	unsigned long long logpos; // undo log entries before it
+} checkpoint;
+
+typedef struct {
+	int addr;
+	evm_word old;
+} undo_rec;
+
+typedef struct {
+	int bufsz;
+	evm_mem *memory;
+	unsigned long long icount;  // instructions executed so far
+	unsigned long long target;  // stop before this instruction (or ~0)
+	int threads;                // the program spawned threads: no history
+	int syscalled;              // a syscall ended the piece of the run
+	int redraw;                 // the terminal echoed input that the program read
+	FILE *out;                  // the program's output, shown in the output pane
+	char *outbuf;
+	size_t outsz;
+	FILE *discard;              // where output goes while going back
+	// both are rings, indexed modulo their size
+	checkpoint *ck;
+	unsigned long long ck_first, ck_end;
+	undo_rec *log;
+	unsigned long long log_first, log_end;
+	int *insns, ninsns; // addresses of the instructions
+	breakpoint bp[MAX_BREAKPOINTS];
+	int nbp;
+	int memaddr;        // first word of the memory window
+	char message[DBG_COLS];
+	char screen[DBG_ROWS][DBG_COLS]; // what the terminal shows
+	int rows; // how many of them are in use
+} debugger;
+
+static int find_breakpoint(debugger *d, int addr)
+{
+	for (int k = 0; k < d->nbp; k++) 
+		if (d->bp[k].addr == addr) return k;
+	return -1;
+}
+
+// index of the instruction at (or else before) addr
+static int find_insn(debugger *d, int addr)
+{
+	int lo = 0, hi = d->ninsns - 1;
+	while (lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+		if (d->insns[mid] <= addr) lo = mid;
+		else hi = mid - 1;
+	}
+	return lo;
+}
+
+static void set_breakpoint(debugger *d, int addr)
+{
+	if (d->nbp == MAX_BREAKPOINTS) return;
+	d->bp[d->nbp++] = (breakpoint){.addr = addr, .op = d->memory->mem[addr].i};
+	d->memory->mem[addr].i = OP_TRAP;
+}
+
+static void clear_breakpoint(debugger *d, int k)
+{
+	d->memory->mem[d->bp[k].addr].i = d->bp[k].op;
+	d->bp[k] = d->bp[--d->nbp];
+}
+
+// put the original opcodes back in place of the traps (or the other way around)
+static void show_originals(debugger *d, int show)
+{
+	for (int k = 0; k < d->nbp; k++) 
+		d->memory->mem[d->bp[k].addr].i = show ? d->bp[k].op : OP_TRAP;
+}
+
+static void dbg_draw(debugger *d, const evm_regs *r)
+{
+	char next[DBG_ROWS][DBG_COLS] = {{0}};
+	evm_word *mem = d->memory->mem;
+	int row = 0;
+
+	snprintf(next[row++], DBG_COLS, "--- CODE (%i breakpoints) -----------------------", d->nbp);
+	show_originals(d, 1);
+	int first = d->ninsns ? find_insn(d, r->ip) - DBG_WINDOW/2 : 0;
+	if (first > d->ninsns - DBG_WINDOW) first = d->ninsns - DBG_WINDOW;
+	if (first < 0) first = 0;
+	for (int i = first; i < first + DBG_WINDOW && i < d->ninsns; i++) {
+		int addr = d->insns[i];
+		char indicator = addr == r->ip ? '>' : find_breakpoint(d, addr) >= 0 ? '*' : ' ';
+		disasm_insn(next[row++], DBG_COLS, mem, addr, indicator);
+	}
+	show_originals(d, 0);
+
+	row = DBG_WINDOW + 1;
+	snprintf(next[row++], DBG_COLS, "--- CPU STATE (instruction %llu) ---------------------", d->icount);
+	int len = 0;
+	bprintf(next[row], DBG_COLS, &len, "\tip  %.8x", r->ip);
+	source_location(next[row++], DBG_COLS, &len, r->ip);
+	snprintf(next[row++], DBG_COLS, "\tsp  %.8x", r->sp);
+	int nregs = evm_numregs(d->memory);
+	if (nregs <= EVM_NUMREGS) {
+		for (int i = 1; i <= nregs; i++) 
+			snprintf(next[row++], DBG_COLS, "\tr%i  %.8x (%i) (%f)", i, r->r[i].u, r->r[i].i, r->r[i].f);
+	} else {
+		// four to a line
+		for (int i = 1; i <= nregs; i += 4) {
+			int len = 0;
+			for (int k = i; k < i+4 && k <= nregs; k++) 
+				bprintf(next[row], DBG_COLS, &len, "\tr%-3i%.8x", k, r->r[k].u);
+			row++;
+		}
+	}
+
+	snprintf(next[row++], DBG_COLS, "--- MEMORY ---------------------------------------");
+	for (int i = d->memaddr; i < d->memaddr + DBG_MEMORY; i++) {
+		if (i >= 0 && i < d->memory->len_data) disasm_data_word(next[row], DBG_COLS, mem, i);
+		row++;
+	}
+
+	// the last lines of the output
+	snprintf(next[row++], DBG_COLS, "--- OUTPUT ---------------------------------------");
+	fflush(d->out);
+	size_t end = d->outsz;
+	if (end && d->outbuf[end-1] == '\n') end--;
+	size_t start = end;
+	int lines = 0;
+	while (start > 0 && lines < DBG_OUTPUT) {
+		start--;
+		if (d->outbuf[start] == '\n') lines++;
+	}
+	if (lines == DBG_OUTPUT) start++;
+	for (int k = 0; k < DBG_OUTPUT; k++) {
+		size_t len = strcspn(d->outbuf + start, "\n");
+		if (start < end) snprintf(next[row], DBG_COLS, "%.*s", (int)(len < end - start ? len : end - start), d->outbuf + start);
+		start += len + 1;
+		row++;
+	}
+
+	snprintf(next[row++], DBG_COLS, "%s", d->message);
+	snprintf(next[row++], DBG_COLS, "[enter] step  r back  c continue  b/g addr breakpoint/go to  t n go to instruction n  m addr memory  q quit");
+
+	for (int i = 0; i < row; i++) {
+		if (!strcmp(next[i], d->screen[i])) continue;
+		// the tabs are expanded by the terminal, so the line is cleared before
+		printf("\x1b[%i;1H\x1b[2K%s", i+1, next[i]);
+		memcpy(d->screen[i], next[i], DBG_COLS);
+	}
+	// the prompt, below everything else
+	printf("\x1b[%i;1H\x1b[2K> ", row+1);
+	d->rows = row;
+	fflush(stdout);
+}
+
+static void drop_checkpoint(debugger *d)
+{
+	d->ck_first++;
+	d->log_first = d->ck_first < d->ck_end ? d->ck[d->ck_first % DBG_CHECKPOINTS].logpos : d->log_end;
+}
+
+// logs the old value of a word that the program writes
+static void dbg_store(void *ctx, int addr, evm_mem *memory)
+{
+	debugger *d = ctx;
+	if (d->threads) return;
+	// a piece has fewer writes than DBG_UNDO, so this leaves a checkpoint
+	if (d->log_end - d->log_first == DBG_UNDO) drop_checkpoint(d);
+	d->log[d->log_end++ % DBG_UNDO] = (undo_rec){.addr = addr, .old = memory->mem[addr]};
+}
+
+// the host's syscalls, which end the piece of the run that they're in; writes
+// to stdout and stderr go to the output pane
+static const char *dbg_syscall(evm_vm *vm)
+{
+	debugger *d = vm->user;
+	int code = vm->r->r[1].i, fd = vm->r->r[2].i;
+	if (code == SYS_SPAWN) d->threads = 1;
+	if (code == SYS_READ && fd == 0) d->redraw = 1;
+
+	const char *err;
+	if (code == SYS_WRITE && (fd == 1 || fd == 2)) {
+		char *buf = sys_buffer(vm, vm->r->r[3].i, vm->r->r[4].i);
+		err = sys_return(vm, buf ? (long long)fwrite(buf, 1, vm->r->r[4].i, vm->out) : -EFAULT);
+	} else {
+		err = host_natives[code](vm);
+	}
+	if (!err) vm->wait = d->syscalled = 1;
+	return err;
+}
+
+// run the program for one instruction, or until it stops or reaches a trap or the target
+static evm_status dbg_exec(debugger *d, evm_vm *vm, evm_regs *state, int step)
+{
+	evm_hooks hooks = {.ctx = d, .store = dbg_store};
+	evm_regs r = *state;
+	for (;;) {
+		if (d->icount == d->target) return (evm_status){.r = r, .nregs = evm_numregs(d->memory)};
+		if (!d->threads && (d->ck_first == d->ck_end || d->icount - d->ck[(d->ck_end-1) % DBG_CHECKPOINTS].icount >= DBG_INTERVAL)) {
+			if (d->ck_end - d->ck_first == DBG_CHECKPOINTS) drop_checkpoint(d);
+			d->ck[d->ck_end++ % DBG_CHECKPOINTS] = (checkpoint){.r = r, .icount = d->icount, .logpos = d->log_end};
+		}
+		unsigned long long n = DBG_INTERVAL;
+		if (!d->threads) n -= d->icount - d->ck[(d->ck_end-1) % DBG_CHECKPOINTS].icount;
+		if (d->target - d->icount < n) n = d->target - d->icount;
+		hooks.limit = (long long)n;
+
+		d->syscalled = 0;
+		evm_status s = evm_run_ex(d->bufsz, d->memory, vm, &r, EVM_HOOKED | (step ? EVM_STEP : 0), &hooks);
+		// the instruction that failed (or trapped) was counted, but didn't execute;
+		// only the checks of ip and sp come before the count
+		if (s.errmsg && s.r.ip >= vm->start_code && s.r.ip < vm->end_code && s.r.sp >= vm->start_data && s.r.sp < vm->end_data) 
+			s.retired--;
+		d->icount += (unsigned long long)s.retired;
+		if (d->syscalled) {
+			d->ck_first = d->ck_end;
+			d->log_first = d->log_end;
+			s.wait = 0;
+		} else if (s.errmsg || s.stop || s.wait || s.retired < hooks.limit) {
+			return s;
+		}
+		if (step) return s;
+		r = s.r;
+	}
+}
+
+// run the program from a breakpoint (or not) for one instruction, or until it stops
+static evm_status dbg_run(debugger *d, evm_vm *vm, evm_regs *state, int step)
+{
+	int k = find_breakpoint(d, state->ip);
+	if (k >= 0) {
+		d->memory->mem[state->ip].i = d->bp[k].op;
+		evm_status s = dbg_exec(d, vm, state, 1);
+		d->memory->mem[d->bp[k].addr].i = OP_TRAP;
+		if (step || s.errmsg || s.stop || s.wait) return s;
+		*state = s.r;
+	}
+	return dbg_exec(d, vm, state, step);
+}
+
+// run the program until instruction n, going back in the history if necessary
+static evm_status dbg_travel(debugger *d, evm_vm *vm, evm_regs *state, unsigned long long n)
+{
+	int replay = n < d->icount;
+	if (replay) {
+		if (d->threads) 
+			return (evm_status){.errmsg = "can't go back after threads were spawned", .r = *state};
+		if (d->ck_first == d->ck_end || d->ck[d->ck_first % DBG_CHECKPOINTS].icount > n) 
+			return (evm_status){.errmsg = "that is before the oldest checkpoint", .r = *state};
+
+		while (d->ck[(d->ck_end-1) % DBG_CHECKPOINTS].icount > n) d->ck_end--;
+		checkpoint c = d->ck[--d->ck_end % DBG_CHECKPOINTS];
+		while (d->log_end > c.logpos) {
+			undo_rec *u = &d->log[--d->log_end % DBG_UNDO];
+			d->memory->mem[u->addr] = u->old;
+		}
+		d->icount = c.icount;
+		*state = c.r;
+	}
+
+	// the program already wrote its output the first time (and going back
+	// doesn't reach a syscall, so only put and fput print)
+	if (replay) vm->out = d->discard;
+
+	d->target = n;
+	show_originals(d, 1);
+	evm_status s = dbg_exec(d, vm, state, 0);
+	show_originals(d, 0);
+	d->target = ~0ULL;
+
+	vm->out = d->out;
+	return s;
+}
+
+const char* interactive(int bufsz, unsigned char *buf)
+{
+	evm_mem *memory = (void*)buf;
+	const char *err = validate_evm_mem(bufsz, memory);  
+	if(err) return err;
+
+	int start_data = 0;
+	int end_data   = memory->len_data;
+	int start_code = end_data;
+	int end_code   = start_code + memory->len_code;
+
+	debugger *d = calloc(1, sizeof(*d));
+	if (d) {
+		d->insns = malloc(sizeof(int) * (memory->len_code + 1));
+		d->ck = malloc(sizeof(checkpoint) * DBG_CHECKPOINTS);
+		d->log = malloc(sizeof(undo_rec) * DBG_UNDO);
+	}
+	if (d) {
+		d->out = open_memstream(&d->outbuf, &d->outsz);
+		d->discard = fopen("/dev/null", "w");
+	}
+	if (!d || !d->insns || !d->ck || !d->log || !d->out || !d->discard) die(0, "out of memory");
+	d->bufsz = bufsz;
+	d->memory = memory;
+	d->target = ~0ULL;
+	d->memaddr = start_data;
+	for (int i = start_code; i < end_code; ) {
+		int op = memory->mem[i].i;
+		if (op < OP_STOP || op >= OP_INVAL) break;
+		d->insns[d->ninsns++] = i;
+		i += 1 + evm_ops[op].nargs;
+	}
+
+	evm_regs state = {.ip = start_code, .sp = end_data-1};
+	if (evm_snapshot_regs(bufsz, memory)) state = *evm_snapshot_regs(bufsz, memory);
+	static evm_native natives[COUNT_ARRAY(host_natives)];
+	for (int i = 0; i < COUNT_ARRAY(host_natives); i++) 
+		natives[i] = host_natives[i] ? dbg_syscall : 0;
+	evm_vm vm = {.user = d, .natives = natives, .nnatives = COUNT_ARRAY(natives), .out = d->out};
+	int done = 0;
+
+	terminal_state(1);
+	for (;;) {
+		// only the lines that changed are drawn, unless the program read from the terminal
+		if (d->redraw) {
+			printf("\x1b[2J");
+			memset(d->screen, 0, sizeof(d->screen));
+			d->redraw = 0;
+		}
+		dbg_draw(d, &state);
+
+		char cmd[500] = {0};
+		if (!fgets(cmd, ssizeof(cmd), stdin) || cmd[0] == 'q') break;
+		// the command was echoed on the prompt line
+		d->screen[d->rows-1][0] = 0;
+
+		char *arg = cmd + 1;
+		int addr = (int)strtol(arg, &arg, 16);
+		int have_addr = arg != cmd + 1;
+		// with debug info, addresses can be given as labels too
+		char *name = cmd + 1 + strspn(cmd + 1, " \t");
+		int label = debug_address(name, (int)strcspn(name, " \t\r\n"));
+		if (label >= 0) addr = label, have_addr = 1;
+		d->message[0] = 0;
+
+		if (cmd[0] == 'b' || cmd[0] == 'g' || cmd[0] == 'm') {
+			int is_insn = have_addr && d->ninsns && d->insns[find_insn(d, addr)] == addr;
+			if (!have_addr) {
+				snprintf(d->message, DBG_COLS, "missing address");
+				continue;
+			} else if (cmd[0] == 'm') {
+				d->memaddr = addr;
+				continue;
+			} else if (!is_insn) {
+				snprintf(d->message, DBG_COLS, "%x is not the address of an instruction", addr);
+				continue;
+			} else if (cmd[0] == 'b') {
+				int k = find_breakpoint(d, addr);
+				if (k >= 0) clear_breakpoint(d, k);
+				else if (d->nbp == MAX_BREAKPOINTS) snprintf(d->message, DBG_COLS, "too many breakpoints");
+				else set_breakpoint(d, addr);
+				continue;
+			}
+		} else if (cmd[0] == 'r' || cmd[0] == 't') {
+			// back one instruction, or to (or forward to) instruction n
+			char *end;
+			unsigned long long n = cmd[0] == 'r' ? d->icount - 1 : strtoull(cmd + 1, &end, 10);
+			if (cmd[0] == 'r' ? d->icount == 0 : end == cmd + 1) {
+				snprintf(d->message, DBG_COLS, cmd[0] == 'r' ? "at the first instruction" : "missing instruction number");
+				continue;
+			}
+			if (n == d->icount) continue;
+			if (n > d->icount && done) {
+				snprintf(d->message, DBG_COLS, "the program has ended");
+				continue;
+			}
+
+			int replay = n < d->icount;
+			evm_status s = dbg_travel(d, &vm, &state, n);
+			state = s.r;
+
+			// going back only fails when the history doesn't reach n
+			if (s.errmsg || s.stop) {
+				snprintf(d->message, DBG_COLS, "%s", s.errmsg ? s.errmsg : "the program has stopped");
+				if (!replay) done = 1;
+			} else {
+				done = 0;
+			}
+			continue;
+		} else if (cmd[0] != 'c' && cmd[0] != 's' && cmd[0] != '\n') {
+			snprintf(d->message, DBG_COLS, "unknown command");
+			continue;
+		}
+
+		if (done) {
+			snprintf(d->message, DBG_COLS, "the program has ended");
+			continue;
+		}
+
+		// step, continue, or go to an address (with a temporary breakpoint)
+		int temporary = cmd[0] == 'g' && find_breakpoint(d, addr) < 0;
+		if (temporary) set_breakpoint(d, addr);
+		int step = cmd[0] == 's' || cmd[0] == '\n';
+
+		evm_status s = dbg_run(d, &vm, &state, step);
+
+		if (temporary) clear_breakpoint(d, find_breakpoint(d, addr));
+		state = s.r;
+
+		if (s.trap && find_breakpoint(d, s.r.ip) >= 0) 
+			snprintf(d->message, DBG_COLS, "breakpoint at %.8x", s.r.ip);
+		else if (s.trap && temporary && s.r.ip == addr) 
+			snprintf(d->message, DBG_COLS, "arrived at %.8x", addr);
+		else if (s.errmsg || s.stop) {
+			snprintf(d->message, DBG_COLS, "%s", s.errmsg ? s.errmsg : "the program has stopped");
+			done = 1;
+		}
+	}
+	terminal_state(0);
+
+	// what the program printed, now on the normal screen
+	heap_release(&vm, 1); // quit: don't wait for the threads
+	fclose(d->out);
+	fwrite(d->outbuf, 1, d->outsz, stdout);
+	free(d->outbuf);
+	fclose(d->discard);
+	free(d->insns);
+	free(d->ck);
+	free(d->log);
+	free(d);
+	return 0;
+}
+
+
+
+/*
+	Translation cache (-C)
+
+	Translating an image (currently: running the optimizer over it) is done
+	once and the result is kept on disk, keyed by a hash of the image header,
+	the code segment and the engine version. Later runs of the same program map
+	the cached code back in instead of translating it again.
+
+	The cache lives in $EVM_CACHE_DIR, or $XDG_CACHE_HOME/evm, or ~/.cache/evm.
+	Entries are written to a temporary file and renamed into place, so
+	concurrent runs never see a partial entry.
+*/
+
+// bump whenever the translated form of an image changes
+#define EVM_ENGINE_VERSION 1
+#define EVM_CACHE_MAGIC (((int)'E')<<16 | ((int)'V')<<8 | ((int)'C'))
+
+typedef struct {
+	int magic;
+	int engine_version;
+	unsigned long long key;
+	int len_code;
+	int reserved;
+	evm_word code[];
+} evm_cache_entry;
+
+unsigned long long image_key(evm_mem *img)
+{
+	int version = EVM_ENGINE_VERSION;
+	unsigned long long h = 0xcbf29ce484222325ULL;
+	h = fnv1a(h, &version, ssizeof(version));
+	h = fnv1a(h, img, ssizeof(*img));
+	h = fnv1a(h, img->mem + img->len_data, 4LL*img->len_code);
+	return h;
+}
+
+static int cache_path(char *out, int outsz, unsigned long long key)
+{
+	char dir[4096];
+	const char *env = getenv("EVM_CACHE_DIR");
+	const char *xdg = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+
+	if (env && *env) snprintf(dir, sizeof(dir), "%s", env);
+	else if (xdg && *xdg) snprintf(dir, sizeof(dir), "%s/evm", xdg);
+	else if (home && *home) snprintf(dir, sizeof(dir), "%s/.cache/evm", home);
+	else return 0;
+
+	// create the directory and its parents
+	for (char *x = dir+1; ; x++) {
+		if (*x == '/' || *x == 0) {
+			char c = *x;
+			*x = 0;
+			mkdir(dir, 0755);
+			*x = c;
+			if (!c) break;
+		}
+	}
+
+	return snprintf(out, outsz, "%s/%.16llx.evmc", dir, key) < outsz;
+}
+
+// map a cache entry; returns 0 on a miss
+static evm_cache_entry *cache_load(unsigned long long key, long long *mapsz)
+{
+	char path[4200];
+	if (!cache_path(path, ssizeof(path), key)) return 0;
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return 0;
+
+	struct stat st;
+	evm_cache_entry *e = MAP_FAILED;
+	if (!fstat(fd, &st) && st.st_size >= ssizeof(*e)) 
+		e = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (e == MAP_FAILED) return 0;
+
+	if (e->magic != EVM_CACHE_MAGIC || e->engine_version != EVM_ENGINE_VERSION || e->key != key ||
+		e->len_code < 0 || ssizeof(*e) + 4LL*e->len_code > st.st_size) {
+		munmap(e, st.st_size);
+		return 0;
+	}
+	*mapsz = st.st_size;
+	return e;
+}
+
+static void cache_store(unsigned long long key, evm_word *code, int len_code)
+{
+	char path[4200], tmp[4300];
+	if (!cache_path(path, ssizeof(path), key)) return;
+	snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", path, (long)getpid());
+
+	FILE *f = fopen(tmp, "wb");
+	if (!f) return;
+	evm_cache_entry e = {
+		.magic = EVM_CACHE_MAGIC, 
+		.engine_version = EVM_ENGINE_VERSION,
+		.key = key,
+		.len_code = len_code,
+	};
+	int ok = fwrite(&e, ssizeof(e), 1, f) == 1;
+	ok &= fwrite(code, 4, len_code, f) == (size_t)len_code;
+	ok &= !fclose(f);
+	if (!ok || rename(tmp, path)) remove(tmp);
+}
+
+// replace the code segment of the image in buf with its cached translation
+const char *load_translated(int bufsz, unsigned char *buf)
+{
+	evm_mem *img = (evm_mem*)buf;
+	const char *err = validate_evm_mem(bufsz, img);
+	if (err) return err;
+
+	unsigned long long key = image_key(img);
+	long long mapsz = 0;
+	evm_cache_entry *e = cache_load(key, &mapsz);
+	if (e) {
+		if (e->len_code <= img->len_code) {
+			memcpy(img->mem + img->len_data, e->code, 4LL*e->len_code);
+			img->len_code = e->len_code;
+		}
+		munmap(e, mapsz);
+		return 0;
+	}
+
+	evm_mem *out = optimize_image(img, &err);
+	if (!out) return 0; // can't be translated, run it as it is
+
+	cache_store(key, out->mem + out->len_data, out->len_code);
+	memcpy(img->mem + img->len_data, out->mem + out->len_data, 4LL*out->len_code);
+	img->len_code = out->len_code;
+	free(out);
+	return 0;
+}
+
+const char* ingest_file(int bufsz, unsigned char *buf, char *fname)
+{
+	FILE *f = fopen(fname, "rb");
+	if(!f) return "couldn't open specified file";
+
+	fseek(f, 0, SEEK_END);
+	long sz = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	if(sz > bufsz) 
+		return "couldn't read specified file, buffer too small";
+
+	if(sz != fread(buf, 1, bufsz, f)) 
+		return "error while reading specified file";
+
+	fclose(f);
+	return 0;
+}
+
+// read a whole file into a malloc'd buffer
+unsigned char *slurp(const char *fname, long *size)
+{
+	FILE *f = fopen(fname, "rb");
+	if(!f) return 0;
+
+	fseek(f, 0, SEEK_END);
+	long sz = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	unsigned char *buf = sz >= 0 ? malloc(sz ? sz : 1) : 0;
+	if (buf && sz != (long)fread(buf, 1, sz, f)) {
+		free(buf);
+		buf = 0;
+	}
+	fclose(f);
+	*size = sz;
+	return buf;
+}
+
+// load the debug info (-g) for an image
+const char *load_debug_info(const char *fname, evm_mem *img)
+{
+	long size = 0;
+	unsigned char *f = slurp(fname, &size);
+	if (!f) return "couldn't read debug info file";
+
+	evm_debug_hdr *hdr = (evm_debug_hdr*)f;
+	if (size < ssizeof(*hdr) || hdr->magic != EVM_DEBUG_MAGIC) {
+		free(f);
+		return "invalid debug info file";
+	}
+	long long expect = ssizeof(*hdr) + ssizeof(debug_line) * (long long)hdr->nlines 
+		+ ssizeof(debug_label) * (long long)hdr->nlabels + hdr->strsz;
+	debug_label *labels = (debug_label*)(f + ssizeof(*hdr) + ssizeof(debug_line) * (long long)hdr->nlines);
+	const char *names = (const char*)(labels + hdr->nlabels);
+	int ok = hdr->nlines >= 0 && hdr->nlabels >= 0 && hdr->strsz > 0 && expect == size && !names[hdr->strsz-1];
+	for (int i = 0; ok && i < hdr->nlabels; i++) 
+		ok = labels[i].name >= 0 && labels[i].name < hdr->strsz;
+	if (!ok) {
+		free(f);
+		return "invalid debug info file";
+	}
+	if (hdr->key != debug_key(img)) {
+		free(f);
+		return "the debug info file is for a different image";
+	}
+
+	free(debug.hdr);
+	debug.hdr = hdr;
+	debug.lines = (debug_line*)(hdr + 1);
+	debug.labels = labels;
+	debug.names = names;
+	return 0;
+}
+
+static int sym_address(evm_obj *o, evm_sym *s, int data_base, int code_base)
+{
+	if (s->flags & SYM_CODE) return s->where - o->len_data + code_base;
+	return s->where + data_base;
+}
+
+/*
+	Link object files into an executable image. All data segments are placed
+	first, in command line order, followed by all code segments in the same
+	order. Execution therefore begins at the code of the first object file.
+*/
+const char *link_objects(char **fnames)
+{
+	int n = 0;
+	while (fnames[n]) n++;
+	if (!n) return "no object files specified";
+
+	evm_obj **objs = calloc(n, sizeof(*objs));
+	int *data_base = calloc(n, sizeof(int));
+	int *code_base = calloc(n, sizeof(int));
+	if (!objs || !data_base || !code_base) die(0, "out of memory");
+
+	int len_data = 0, len_code = 0;
+	for (int i = 0; i < n; i++) {
+		long sz = 0;
+		evm_obj *o = (evm_obj*)slurp(fnames[i], &sz);
+		if (!o) die(0, "%s: couldn't read object file", fnames[i]);
+
+		if (sz < ssizeof(*o) || o->magic != EVM_OBJ_MAGIC)
+			die(0, "%s: not an object file", fnames[i]);
+		if (o->len_data < 0 || o->len_code < 0 || o->nsyms < 0 || o->nrelocs < 0 ||
+			ssizeof(*o) + 4LL*(o->len_data + o->len_code) 
+			+ ssizeof(evm_sym)*o->nsyms + ssizeof(evm_reloc)*o->nrelocs > sz)
+			die(0, "%s: corrupt object file", fnames[i]);
+
+		objs[i] = o;
+		data_base[i] = len_data;
+		len_data += o->len_data;
+	}
+	for (int i = 0; i < n; i++) {
+		code_base[i] = len_data + len_code;
+		len_code += objs[i]->len_code;
+	}
+
+	evm_mem *img = calloc(1, ssizeof(*img) + 4LL*(len_data + len_code));
+	if (!img) die(0, "out of memory");
+	img->magic = EVM_MAGIC;
+	img->version = 1;
+	img->len_data = len_data;
+	img->len_code = len_code;
+	int nregs = EVM_NUMREGS;
+	for (int i = 0; i < n; i++) {
+		int k = (objs[i]->version >> EVM_REGS_SHIFT) & EVM_REGS_MASK;
+		if (k > nregs) nregs = k;
+	}
+	if (nregs > EVM_NUMREGS) img->version |= nregs << EVM_REGS_SHIFT;
+
+	for (int i = 0; i < n; i++) {
+		evm_obj *o = objs[i];
+		memcpy(img->mem + data_base[i], o->mem, 4LL*o->len_data);
+		memcpy(img->mem + code_base[i], o->mem + o->len_data, 4LL*o->len_code);
+	}
+
+	for (int i = 0; i < n; i++) {
+		evm_obj *o = objs[i];
+		evm_sym *syms = obj_syms(o);
+		evm_reloc *relocs = obj_relocs(o);
+
+		for (int k = 0; k < o->nrelocs; k++) {
+			evm_reloc r = relocs[k];
+			if (r.where < 0 || r.where >= o->len_data + o->len_code)
+				die(0, "%s: relocation outside of module", fnames[i]);
+
+			int at = r.where < o->len_data 
+				? data_base[i] + r.where 
+				: code_base[i] + r.where - o->len_data;
+
+			if (r.kind == RELOC_DATA) {
+				img->mem[at].i += data_base[i];
+			} else if (r.kind == RELOC_CODE) {
+				img->mem[at].i += code_base[i] - o->len_data;
+			} else if (r.kind == RELOC_IMPORT && r.sym >= 0 && r.sym < o->nsyms) {
+				const char *name = syms[r.sym].name;
+				int found = 0, addr = 0;
+				for (int j = 0; j < n; j++) {
+					evm_sym *s = obj_syms(objs[j]);
+					for (int m = 0; m < objs[j]->nsyms; m++) {
+						if (!(s[m].flags & SYM_EXPORT)) continue;
+						if (strncmp(s[m].name, name, EVM_SYMLEN)) continue;
+						if (found) die(0, "Symbol %.*s is exported more than once", EVM_SYMLEN, name);
+						addr = sym_address(objs[j], &s[m], data_base[j], code_base[j]);
+						found = 1;
+					}
+				}
+				if (!found) die(0, "%s: undefined symbol %.*s", fnames[i], EVM_SYMLEN, name);
+				img->mem[at].i += addr;
+			} else die(0, "%s: invalid relocation", fnames[i]);
+		}
+	}
+
+	fwrite(img, 1, ssizeof(*img) + 4LL*(len_data + len_code), stdout);
+	return 0;
+}
+
+/*
+	Execution trace (-t, -r)
+
+	With -t, every executed instruction is recorded into a fixed-size ring
+	buffer in memory: its address and opcode, the register it changed and the
+	new value, and the data address it wrote. The buffer is written to a file
+	when the program fails, or when the process receives SIGUSR1. -r replays
+	such a file against the disassembly of the image.
+*/
+
+#define TRACE_RECORDS (1<<16)
+#define EVM_TRACE_MAGIC (((int)'E')<<16 | ((int)'V')<<8 | ((int)'T'))
+
+typedef struct {
+	int ip;
+	unsigned char op;
+	signed char reg; // register changed by the instruction, or -1
+	short failed;    // the program stopped with an error at this instruction
+	int value;       // new value of that register
+	int addr;        // data address written, or -1
+} trace_rec;
+
+typedef struct {
+	int magic;
+	int nrecs;
+	unsigned long long key; // image_key() of the traced image
+} trace_hdr;
+
+typedef struct {
+	trace_rec *ring;
+	unsigned long long n; // records written so far
+	trace_rec pending;
+	int have_pending;
+	evm_regs prev;
+	const char *fname;
+	unsigned long long key;
+} trace_ctx;
+
+static volatile sig_atomic_t trace_dump_requested;
+
+static void trace_request_handler(int sig)
+{
+	(void)sig;
+	trace_dump_requested = 1;
+}
+
+// complete the record of the last instruction, given the registers after it (or when it failed)
+static void trace_finish_pending(trace_ctx *t, const evm_regs *now, int failed)
+{
+	if (!t->have_pending) return;
+	t->pending.failed = (short)failed;
+
+	// prefer a general purpose register; sp also changes with push and pop
+	for (int i = 1; i <= EVM_MAXREGS + 1; i++) {
+		int k = i % (EVM_MAXREGS + 1);
+		if (now->r[k].u != t->prev.r[k].u) {
+			t->pending.reg = k;
+			t->pending.value = now->r[k].i;
+			break;
+		}
+	}
+	t->ring[t->n++ % TRACE_RECORDS] = t->pending;
+	t->have_pending = 0;
+}
+
+static const char *trace_dump(trace_ctx *t)
+{
+	FILE *f = fopen(t->fname, "wb");
+	if (!f) return "couldn't open trace file for writing";
+
+	int nrecs = t->n < TRACE_RECORDS ? (int)t->n : TRACE_RECORDS;
+	trace_hdr hdr = {.magic = EVM_TRACE_MAGIC, .nrecs = nrecs, .key = t->key};
+	fwrite(&hdr, ssizeof(hdr), 1, f);
+	for (unsigned long long i = t->n - nrecs; i < t->n; i++) 
+		fwrite(&t->ring[i % TRACE_RECORDS], ssizeof(trace_rec), 1, f);
+
+	if (fclose(f)) return "error while writing trace file";
+	return 0;
+}
+
+static int trace_hook(void *ctx, const evm_regs *r, evm_mem *memory)
+{
+	trace_ctx *t = ctx;
+	trace_finish_pending(t, r, 0);
+
+	if (trace_dump_requested) {
+		trace_dump_requested = 0;
+		const char *err = trace_dump(t);
+		if (err) fprintf(stderr, "%s\n", err);
+	}
+
+	t->pending = (trace_rec){.ip = r->ip, .op = memory->mem[r->ip].i, .reg = -1, .addr = -1};
+	int addr;
+	if (insn_mem_access(memory->mem, r, &addr) & MEM_WRITE) t->pending.addr = addr;
+	t->prev = *r;
+	t->have_pending = 1;
+	return 0;
+}
+
+const char *trace(int bufsz, unsigned char *buf, const char *fname)
+{
+	evm_mem *img = (evm_mem*)buf;
+	const char *err = validate_evm_mem(bufsz, img);
+	if (err) return err;
+
+	trace_ctx t = {
+		.ring = malloc(ssizeof(trace_rec) * TRACE_RECORDS),
+		.fname = fname,
+		.key = image_key(img),
+	};
+	if (!t.ring) die(0, "out of memory");
+
+	struct sigaction sa = {.sa_handler = trace_request_handler, .sa_flags = SA_RESTART};
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR1, &sa, 0);
+
+	evm_hooks hooks = {.ctx = &t, .insn = trace_hook};
+	evm_vm vm = host_vm(0);
+	evm_status s = evm_run_ex(bufsz, img, &vm, evm_snapshot_regs(bufsz, img), EVM_DEFAULT_FLAGS | EVM_HOOKED, &hooks);
+	heap_release(&vm, s.errmsg != 0);
+
+	// the checks of ip and sp come before the hook, so a failure there is in
+	// an instruction that wasn't recorded yet, after the pending one completed
+	int failed_pending = s.errmsg && t.have_pending && t.pending.ip == s.r.ip;
+	trace_finish_pending(&t, &s.r, failed_pending);
+	if (s.errmsg && !failed_pending) {
+		int in_code = s.r.ip >= img->len_data && s.r.ip < img->len_data + img->len_code;
+		t.ring[t.n++ % TRACE_RECORDS] = (trace_rec){.ip = s.r.ip, .op = in_code ? img->mem[s.r.ip].i : 0, .reg = -1, .failed = 1, .addr = -1};
+	}
+
+	if (s.errmsg) {
+		fflush(stdout);
+		report_error(s);
+		err = trace_dump(&t);
+		if (err) fprintf(stderr, "%s\n", err);
+		else fprintf(stderr, "last %i instructions written to %s\n", t.n < TRACE_RECORDS ? (int)t.n : TRACE_RECORDS, fname);
+		exit(EXIT_FAILURE);
+	}
+	free(t.ring);
+	return 0;
+}
+
+/*
+	Memory access profiler (-m)
+
+	Counts reads and writes of every data segment word, and looks for access
+	streams: for each load or store instruction, the distance between the
+	addresses of consecutive executions. An instruction that keeps stepping by
+	the same distance is walking through an array, which is where bulk or
+	vector operations would pay off.
+*/
+
+typedef struct {
+	int last, stride, run;
+	int longest, longest_stride;
+	unsigned long long accesses, in_stream;
+} mem_stream;
+
+typedef struct {
+	int len_data, start_code;
+	unsigned long long *reads, *writes;
+	mem_stream *streams; // indexed by ip - start of code
+} mem_ctx;
+
+static int mem_hook(void *ctx, const evm_regs *r, evm_mem *memory)
+{
+	mem_ctx *m = ctx;
+	int addr;
+	int kind = insn_mem_access(memory->mem, r, &addr);
+	if (!kind) return 0;
+
+	if (addr >= 0 && addr < m->len_data) {
+		if (kind & MEM_READ) m->reads[addr]++;
+		if (kind & MEM_WRITE) m->writes[addr]++;
+	}
+
+	mem_stream *s = &m->streams[r->ip - m->start_code];
+	if (s->accesses) {
+		int d = addr - s->last;
+		if (d == s->stride) {
+			s->run++;
+			s->in_stream++;
+		} else {
+			s->stride = d;
+			s->run = 1;
+		}
+		if (s->run > s->longest) {
+			s->longest = s->run;
+			s->longest_stride = s->stride;
+		}
+	}
+	s->last = addr;
+	s->accesses++;
+	return 0;
+}
+
+const char *memprofile(int bufsz, unsigned char *buf)
+{
+	evm_mem *img = (evm_mem*)buf;
+	const char *err = validate_evm_mem(bufsz, img);
+	if (err) return err;
+
+	// the data segment changes during the run, so keep the original for the report
+	evm_word *initial = malloc(4LL*img->len_data + 4);
+	mem_ctx m = {
+		.len_data = img->len_data,
+		.start_code = img->len_data,
+		.reads = calloc(img->len_data + 1, sizeof(unsigned long long)),
+		.writes = calloc(img->len_data + 1, sizeof(unsigned long long)),
+		.streams = calloc(img->len_code + 1, sizeof(mem_stream)),
+	};
+	if (!initial || !m.reads || !m.writes || !m.streams) die(0, "out of memory");
+	memcpy(initial, img->mem, 4LL*img->len_data);
+
+	evm_hooks hooks = {.ctx = &m, .insn = mem_hook};
+	evm_vm vm = host_vm(0);
+	evm_status s = evm_run_ex(bufsz, img, &vm, evm_snapshot_regs(bufsz, img), EVM_DEFAULT_FLAGS | EVM_HOOKED, &hooks);
+	heap_release(&vm, s.errmsg != 0);
+	fflush(stdout);
+
+	fprintf(stderr, "--- DATA ACCESSES ---------------------------------\n");
+	fprintf(stderr, "       reads      writes   address     hex        decimal int      float   ascii\n");
+	int skipped = 0;
+	for (int i = 0; i < img->len_data; i++) {
+		if (!m.reads[i] && !m.writes[i]) {
+			skipped++;
+			continue;
+		}
+		if (skipped) fprintf(stderr, "                           ... %i words not accessed\n", skipped);
+		skipped = 0;
+
+		char line[256];
+		disasm_data_word(line, ssizeof(line), initial, i);
+		fprintf(stderr, "%12llu%12llu   %s\n", m.reads[i], m.writes[i], line);
+	}
+	if (skipped) fprintf(stderr, "                           ... %i words not accessed\n", skipped);
+
+	fprintf(stderr, "--- ACCESS STREAMS -------------------------------\n");
+	fprintf(stderr, "    accesses   in stream   longest   stride   pattern\n");
+	for (int ip = img->len_data; ip < img->len_data + img->len_code; ip++) {
+		mem_stream *st = &m.streams[ip - img->len_data];
+		if (!st->accesses) continue;
+
+		const char *pattern = "irregular";
+		if (st->accesses == 1) pattern = "single access";
+		else if (st->in_stream * 2 >= st->accesses) {
+			if (st->longest_stride == 0) pattern = "same address";
+			else if (st->longest_stride == 1 || st->longest_stride == -1) pattern = "sequential";
+			else pattern = "strided";
+		}
+
+		char line[256];
+		disasm_insn(line, ssizeof(line), img->mem, ip, ' ');
+		fprintf(stderr, "%12llu%12llu%10i%9i   %-14s%s\n", st->accesses, st->in_stream, 
+			st->longest, st->longest_stride, pattern, line);
+	}
+
+	free(initial);
+	free(m.reads);
+	free(m.writes);
+	free(m.streams);
+
+	if (s.errmsg) {
+		report_error(s);
+		exit(EXIT_FAILURE);
+	}
+	return 0;
+}
+
+const char *replay(int bufsz, unsigned char *buf, const char *fname)
+{
+	evm_mem *img = (evm_mem*)buf;
+	const char *err = validate_evm_mem(bufsz, img);
+	if (err) return err;
+
+	long sz = 0;
+	trace_hdr *hdr = (trace_hdr*)slurp(fname, &sz);
+	if (!hdr) return "couldn't read trace file";
+	if (sz < ssizeof(*hdr) || hdr->magic != EVM_TRACE_MAGIC || hdr->nrecs < 0 ||
+		ssizeof(*hdr) + ssizeof(trace_rec) * hdr->nrecs > sz) 
+		return "invalid trace file";
+	if (hdr->key != image_key(img)) 
+		fprintf(stderr, "warning: trace was recorded from a different image\n");
+
+	trace_rec *recs = (trace_rec*)(hdr + 1);
+	int start_code = img->len_data, end_code = start_code + img->len_code;
+
+	printf("--- TRACE (%i instructions, oldest first) --------\n", hdr->nrecs);
+	for (int i = 0; i < hdr->nrecs; i++) {
+		trace_rec t = recs[i];
+		char line[256] = "(outside of code segment)";
+		if (t.ip >= start_code && t.ip < end_code) 
+			disasm_insn(line, ssizeof(line), img->mem, t.ip, ' ');
+
+		printf("%8i   %-72s", i - hdr->nrecs, line);
+		if (t.reg == 0) printf("  sp = %i", t.value);
+		else if (t.reg > 0) printf("  r%i = %i (%f)", t.reg, t.value, ((evm_word){.i = t.value}).f);
+		if (t.addr >= 0) printf("  [%x] %s", t.addr, t.failed ? "not written" : "written");
+		if (t.failed) printf("  <<< failed here");
+		printf("\n");
+	}
+	free(hdr);
+	return 0;
+}
+
+/*
+	Watchpoints (-w first-last, -wstop)
+
+	The pages that hold watched words are made read-only, so the program runs
+	at full speed until it writes to one of them. The SIGSEGV handler then
+	makes the page writable and sets the trap flag, so that the host executes
+	just the store before SIGTRAP arrives; that handler protects the page
+	again and, if the word is watched, reports the ip (published by the
+	interpreter) and the instruction that wrote it. Syscalls are wrapped to
+	report what they write into watched words. Without a way to single-step
+	the host (anything but x86-64 Linux), a page stays writable after its
+	first write, so only that write is reported.
+*/
+
+#define MAX_WATCHES 16
+
+typedef struct {
+	const char *spec; // as given (resolved when the debug info, if any, is loaded)
+	int first, last;  // watched words
+} watch_range;
+
+static watch_range watches[MAX_WATCHES];
+static int nwatches, watch_stop;
+
+static evm_word *watch_mem;
+static long watch_pagesz;
+static volatile int watch_ip = -1;
+static evm_word *watch_old; // the watched words, around syscalls
+static sigjmp_buf watch_jmp;
+static struct {
+	char *page;
+	int addr, ip;
+	evm_word old;
+} watch_pending;
+
+static int watched(int addr)
+{
+	for (int i = 0; i < nwatches; i++) 
+		if (addr >= watches[i].first && addr <= watches[i].last) return 1;
+	return 0;
+}
+
+static char *watch_page(int addr)
+{
+	return (char*)((unsigned long)&watch_mem[addr] & ~(unsigned long)(watch_pagesz-1));
+}
+
+static void watch_protect(int prot)
+{
+	for (int i = 0; i < nwatches; i++) {
+		char *first = watch_page(watches[i].first), *last = watch_page(watches[i].last);
+		mprotect(first, last - first + watch_pagesz, prot);
+	}
+}
+
+// called from the signal handlers too, so it only formats into a buffer and writes it
+static void watch_report(int ip, int addr, evm_word old, evm_word new, int known)
+{
+	char line[512], insn[256], name[128] = {0};
+	if (!disasm_insn(insn, ssizeof(insn), watch_mem, ip, ' ')) snprintf(insn, ssizeof(insn), "%.8x", ip);
+	int len = 0;
+	symbolize(name, ssizeof(name), &len, addr);
+	int n = known ? 
+		snprintf(line, ssizeof(line), "watch %.8x%s: %i -> %i   %s\n", addr, name, old.i, new.i, insn) :
+		snprintf(line, ssizeof(line), "watch %.8x%s: %i -> ?   %s\n", addr, name, old.i, insn);
+	if (write(2, line, n < ssizeof(line) ? n : ssizeof(line)-1) < 0) return;
+}
+
+static void watch_segv(int sig, siginfo_t *si, void *ucontext)
+{
+	char *a = si->si_addr;
+	int addr = (int)((a - (char*)watch_mem) / ssizeof(evm_word));
+	int ours = 0;
+	for (int i = 0; i < nwatches; i++) {
+		if (a >= watch_page(watches[i].first) && a < watch_page(watches[i].last) + watch_pagesz) ours = 1;
+	}
+	if (!ours) {
+		// a real crash
+		signal(sig, SIG_DFL);
+		return;
+	}
+
+	char *page = (char*)((unsigned long)a & ~(unsigned long)(watch_pagesz-1));
+	mprotect(page, watch_pagesz, PROT_READ | PROT_WRITE);
+#if defined(__linux__) && defined(__x86_64__)
+	ucontext_t *uc = ucontext;
+	uc->uc_mcontext.gregs[REG_EFL] |= 0x100; // trap flag
+	watch_pending.page = page;
+	watch_pending.addr = addr;
+	watch_pending.ip = watch_ip;
+	watch_pending.old = watch_mem[addr];
+#else
+	(void)ucontext;
+	if (watched(addr)) {
+		watch_report(watch_ip, addr, watch_mem[addr], watch_mem[addr], 0);
+		if (watch_stop) siglongjmp(watch_jmp, 1);
+	}
+#endif
+}
+
+#if defined(__linux__) && defined(__x86_64__)
+static void watch_trap(int sig, siginfo_t *si, void *ucontext)
+{
+	(void)sig; (void)si;
+	ucontext_t *uc = ucontext;
+	if (!watch_pending.page) return;
+	uc->uc_mcontext.gregs[REG_EFL] &= ~0x100;
+	mprotect(watch_pending.page, watch_pagesz, PROT_READ);
+	watch_pending.page = 0;
+
+	int addr = watch_pending.addr;
+	if (watched(addr)) {
+		watch_report(watch_pending.ip, addr, watch_pending.old, watch_mem[addr], 1);
+		if (watch_stop) siglongjmp(watch_jmp, 1);
+	}
+}
+#endif
+
+// the host's syscalls, with their writes to watched words reported
+static const char *watch_syscall(evm_vm *vm)
+{
+	int code = vm->r->r[1].i;
+	if (code == SYS_SPAWN) return "threads can't run with watchpoints";
+
+	watch_protect(PROT_READ | PROT_WRITE);
+	for (int i = 0, k = 0; i < nwatches; k += watches[i].last - watches[i].first + 1, i++) 
+		memcpy(&watch_old[k], &watch_mem[watches[i].first], sizeof(evm_word) * (watches[i].last - watches[i].first + 1));
+	int ip = vm->r->ip;
+	const char *err = host_natives[code](vm);
+
+	int changed = 0;
+	for (int i = 0, k = 0; i < nwatches; i++) {
+		for (int addr = watches[i].first; addr <= watches[i].last; addr++, k++) {
+			if (watch_old[k].u == watch_mem[addr].u) continue;
+			watch_report(ip, addr, watch_old[k], watch_mem[addr], 1);
+			changed = 1;
+		}
+	}
+	watch_protect(PROT_READ);
+	if (!err && changed && watch_stop) return "stopped at a write to a watched word";
+	return err;
+}
+
+// an end of a watched range: a hex address, or a label (from the debug info) with an optional +offset
+static int watch_address(const char *s, char **end)
+{
+	int addr = (int)strtol(s, end, 16);
+	int len = (int)strcspn(s, "+-");
+	int label = debug_address(s, len);
+	if (label >= 0) {
+		addr = label;
+		*end = (char*)s + len;
+		if (**end == '+') addr += (int)strtol(*end + 1, end, 10);
+	}
+	return addr;
+}
+
+const char *watch(int bufsz, unsigned char *buf)
+{
+	evm_mem *img = (evm_mem*)buf;
+	const char *err = validate_evm_mem(bufsz, img);
+	if (err) return err;
+
+	int total = 0;
+	for (int i = 0; i < nwatches; i++) {
+		char *end;
+		watches[i].first = watches[i].last = watch_address(watches[i].spec, &end);
+		if (end != watches[i].spec && *end == '-') watches[i].last = watch_address(end + 1, &end);
+		if (end == watches[i].spec || *end) 
+			return "watchpoints are addresses (in hex) or labels, or ranges of them, e.g. 1f, 10-1f, array or array+2-array+5";
+		if (watches[i].first < 0 || watches[i].last < watches[i].first || watches[i].last >= img->len_data) 
+			return "watched words must be in the data segment";
+		total += watches[i].last - watches[i].first + 1;
+	}
+
+	// the program runs in a copy of the image on pages of its own (with room for a heap)
+	watch_pagesz = sysconf(_SC_PAGESIZE);
+	long image = ssizeof(evm_mem) + ssizeof(evm_word) * (img->len_data + img->len_code) + ssizeof(evm_regs);
+	if (image > bufsz) image = bufsz;
+	long size = (bufsz + watch_pagesz - 1) & ~(watch_pagesz - 1);
+	evm_mem *copy = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (copy == MAP_FAILED) return "couldn't map memory for the watched program";
+	memcpy(copy, img, image);
+	watch_mem = copy->mem;
+	watch_old = malloc(sizeof(evm_word) * total);
+	if (!watch_old) die(0, "out of memory");
+
+	static evm_native natives[COUNT_ARRAY(host_natives)];
+	for (int i = 0; i < COUNT_ARRAY(host_natives); i++) 
+		natives[i] = host_natives[i] ? watch_syscall : 0;
+	evm_vm vm = {.natives = natives, .nnatives = COUNT_ARRAY(natives)};
+
+	struct sigaction sa = {.sa_sigaction = watch_segv, .sa_flags = SA_SIGINFO};
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGSEGV, &sa, 0);
+#if defined(__linux__) && defined(__x86_64__)
+	sa.sa_sigaction = watch_trap;
+	sigaction(SIGTRAP, &sa, 0);
+#endif
+
+	evm_hooks hooks = {.ip_out = &watch_ip};
+	evm_status s = {0};
+	int stopped = sigsetjmp(watch_jmp, 1);
+	if (!stopped) {
+		watch_protect(PROT_READ);
+		s = evm_run_ex((int)size, copy, &vm, evm_snapshot_regs((int)size, copy), EVM_DEFAULT_FLAGS | EVM_PUBLISH, &hooks);
+	}
+	watch_protect(PROT_READ | PROT_WRITE);
+	signal(SIGSEGV, SIG_DFL);
+	signal(SIGTRAP, SIG_DFL);
+	fflush(stdout);
+
+	heap_release(&vm, 0);
+	munmap(copy, size);
+	free(watch_old);
+	if (stopped) return "stopped at a write to a watched word";
+	if (s.errmsg) {
+		report_error(s);
+		exit(EXIT_FAILURE);
+	}
+	return 0;
+}
+
+/*
+	Snapshots (-S file) and clones (-clone n)
+
+	With -S, a program runs until its snapshot syscall, and is then saved as a
+	snapshot image: its data segment as it is at that point, its code, and
+	its registers, to resume after the syscall with r1 = 1. Running the
+	snapshot skips everything that the program did before the syscall (e.g.
+	building tables). Other threads are not saved.
+
+	-clone keeps an image in memory, and runs it the given number of times,
+	each time from a copy-on-write mapping of it: a run only pays for copying
+	the pages of the image that it writes.
+*/
+
+static const char *sys_snapshot_park(evm_vm *vm)
+{
+	// the snapshot only has the image
+	if (vm->heap && vm->heap->end > vm->heap->start) return "can't take a snapshot of a program that uses the heap";
+	vm->wait = 1;
+	return 0;
+}
+
+static const evm_native snapshot_natives[] = {
+	[SYS_READ]  = sys_read,
+	[SYS_WRITE] = sys_write,
+	[SYS_OPEN]  = sys_open,
+	[SYS_CLOSE] = sys_close,
+	[SYS_CLOCK] = sys_clock,
+	[SYS_SPAWN] = sys_spawn,
+	[SYS_JOIN]  = sys_join,
+	[SYS_SNAPSHOT] = sys_snapshot_park,
+	[SYS_ALLOC]  = sys_alloc,
+	[SYS_FREE]   = sys_free,
+	[SYS_RESIZE] = sys_resize,
+};
+
+const char *take_snapshot(int bufsz, unsigned char *buf, const char *fname)
+{
+	evm_mem *img = (evm_mem*)buf;
+	const char *err = validate_evm_mem(bufsz, img);
+	if (err) return err;
+
+	evm_vm vm = {.natives = snapshot_natives, .nnatives = COUNT_ARRAY(snapshot_natives)};
+	evm_status s = evm_run(bufsz, img, &vm, evm_snapshot_regs(bufsz, img), 0);
+	if (s.errmsg) {
+		fflush(stdout);
+		report_error(s);
+		return "program failed before taking a snapshot";
+	}
+	if (!s.wait) return "program stopped without taking a snapshot";
+
+	evm_regs r = s.r;
+	r.r[1].i = 1;
+	img->version |= EVM_SNAPSHOT;
+
+	FILE *f = fopen(fname, "wb");
+	if (!f) return "can't create snapshot file";
+	fwrite(img, 1, ssizeof(*img) + 4LL*(img->len_data + img->len_code), f);
+	fwrite(&r, 1, ssizeof(r), f);
+	if (fclose(f)) return "error while writing snapshot file";
+	return 0;
+}
+
+const char *run_clones(int n, char *fname, run_metrics *metrics)
+{
+	long size = 0;
+	unsigned char *data = slurp(fname, &size);
+	if (!data) return "couldn't open specified file";
+	const char *err = validate_evm_mem((int)size, (evm_mem*)data);
+
+#ifdef __linux__
+	int fd = err ? -1 : memfd_create("evm-image", MFD_CLOEXEC);
+	if (fd >= 0 && write(fd, data, size) != size) err = "can't copy image into memory";
+	// room for a heap after the image (the pages that a run doesn't touch cost nothing)
+	if (fd >= 0 && !err && size < MAX_IMAGE_BYTES && !ftruncate(fd, MAX_IMAGE_BYTES)) size = MAX_IMAGE_BYTES;
+#else
+	int fd = err ? -1 : open(fname, O_RDONLY | O_CLOEXEC);
+#endif
+	free(data);
+	if (!err && fd < 0) err = "can't keep image in memory";
+
+	for (int i = 0; i < n && !err; i++) {
+		double wall = seconds(CLOCK_MONOTONIC), cpu = seconds(CLOCK_PROCESS_CPUTIME_ID);
+		evm_mem *img = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		if (img == MAP_FAILED) {
+			err = "can't map image";
+			break;
+		}
+
+		evm_vm vm = host_vm(0);
+		evm_status s = evm_run((int)size, img, &vm, evm_snapshot_regs((int)size, img), 0);
+		heap_release(&vm, s.errmsg != 0);
+		munmap(img, size);
+		wall = seconds(CLOCK_MONOTONIC) - wall;
+		cpu = seconds(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+
+		metrics_record(metrics, fname, s, wall, cpu);
+		if (s.errmsg) {
+			fflush(stdout);
+			report_error(s);
+			err = "program failed";
+		}
+	}
+	if (fd >= 0) close(fd);
+	return err;
+}
+
+/*
+	Batched execution (-batch inputs)
+
+	Runs one program once for every line of the inputs file, in lockstep
+	(see evm_run_batch). The numbers on a line are stored at the start of that
+	instance's data segment, integers as integers and numbers with a decimal
+	point or exponent as floats. Each instance prints into its own buffer, and
+	the outputs are printed in the order of the lines when all have finished.
+*/
+
+const char *batch(int bufsz, unsigned char *buf, const char *inputs)
+{
+	evm_mem *img = (evm_mem*)buf;
+	const char *err = validate_evm_mem(bufsz, img);
+	if (err) return err;
+
+	long size = 0;
+	char *text = (char*)slurp(inputs, &size);
+	if (!text) return "couldn't open input file";
+	text = realloc(text, size+1);
+	text[size] = 0;
+
+	int lanes = 0;
+	for (char *line = text; *line; line++) {
+		char *end = line + strcspn(line, "\n");
+		if (line + strspn(line, " \t\r") < end) lanes++;
+		line = end;
+		if (!*line) break;
+	}
+	if (!lanes) {
+		free(text);
+		return "input file has no lines";
+	}
+
+	int len_data = img->len_data;
+	evm_word *data = malloc((size_t)lanes * (len_data ? len_data : 1) * sizeof(evm_word));
+	evm_status *status = calloc(lanes, sizeof(*status));
+	FILE **out = calloc(lanes, sizeof(*out));
+	char **outbuf = calloc(lanes, sizeof(*outbuf));
+	size_t *outsz = calloc(lanes, sizeof(*outsz));
+	int *lineno = calloc(lanes, sizeof(*lineno)); // of each lane's line in the input file
+	if (!data || !status || !out || !outbuf || !outsz || !lineno) die(0, "out of memory");
+
+	for (int i = 0; i < len_data; i++) 
+		for (int l = 0; l < lanes; l++) 
+			data[(size_t)i*lanes + l] = img->mem[i];
+
+	static char errbuf[64];
+	int l = 0, n = 0;
+	for (char *line = text, *next; *line; line = next) {
+		next = line + strcspn(line, "\n");
+		if (*next) *next++ = 0;
+		n++;
+		if (!line[strspn(line, " \t\r")]) continue;
+		char *p = line;
+		for (int i = 0; i < len_data; i++) {
+			char *end;
+			p += strspn(p, " \t\r,");
+			if (!*p) break;
+			size_t numlen = strcspn(p, " \t\r,");
+			// an integer (decimal, hex or octal), or else a float
+			evm_word w;
+			w.i = (int)strtol(p, &end, 0);
+			int hex = (p[0] == '-' || p[0] == '+' ? p[1] == '0' && (p[2] == 'x' || p[2] == 'X') : p[0] == '0' && (p[1] == 'x' || p[1] == 'X'));
+			if (end != p + numlen && !hex) w.f = strtof(p, &end);
+			if (end != p + numlen) {
+				snprintf(errbuf, sizeof(errbuf), "invalid number on line %i of the input file", n);
+				err = errbuf;
+				break;
+			}
+			data[(size_t)i*lanes + l] = w;
+			p = end;
+		}
+		if (err) break;
+		lineno[l] = n;
+		out[l] = open_memstream(&outbuf[l], &outsz[l]);
+		if (!out[l]) die(0, "out of memory");
+		l++;
+	}
+
+	int failed = 0;
+	if (!err) {
+		evm_batch b = {.lanes = lanes, .data = data, .out = out, .status = status};
+		err = evm_run_batch(bufsz, img, &b);
+	}
+	for (l = 0; l < lanes; l++) {
+		if (!out[l]) continue;
+		fclose(out[l]);
+		fwrite(outbuf[l], 1, outsz[l], stdout);
+		free(outbuf[l]);
+		if (!err && status[l].errmsg) {
+			fflush(stdout);
+			fprintf(stderr, "line %i: ", lineno[l]);
+			report_error(status[l]);
+			failed++;
+		}
+	}
+
+	free(text);
+	free(data);
+	free(status);
+	free(out);
+	free(outbuf);
+	free(outsz);
+	free(lineno);
+	if (!err && failed) err = "one or more instances failed";
+	return err;
+}
+
+/*
+	Asynchronous I/O (-async)
+
+	Runs several programs at once on one thread. A read or write syscall on a
+	file descriptor that isn't ready, or a join of a thread that is still
+	running, parks the program: evm_run returns with the wait flag set, and a
+	duplicate of the file descriptor is added to an epoll set. When it becomes
+	ready, the operation is completed (directly on the program's memory) and
+	the program is resumed. In the meantime, the other programs run. Programs
+	are not preempted otherwise; their threads run on host threads as usual.
+*/
+
+#ifdef __linux__
+
+typedef struct {
+	const char *fname;
+	unsigned char *buf;
+	long size;
+	evm_vm vm;
+	evm_regs r;   // where to resume
+	int started;
+	int parkfd;   // the file descriptor that the parked syscall waits for,
+	unsigned parkevents; // and the events
+	int waitfd;   // duplicate of parkfd in the epoll set, or -1
+	int written;  // bytes of the current write syscall that are out already
+	const char *errmsg; // the completed syscall failed, and so does the program
+	int done;
+} async_task;
+
+static int would_block(int fd, short events)
+{
+	struct pollfd p = {.fd = fd, .events = events};
+	return poll(&p, 1, 0) == 0;
+}
+
+// parks the program until fd has one of the events
+static const char *async_park(evm_vm *vm, int fd, unsigned events)
+{
+	async_task *t = vm->user;
+	t->parkfd = fd;
+	t->parkevents = events;
+	vm->wait = 1;
+	return 0;
+}
+
+static const char *sys_read_async(evm_vm *vm)
+{
+	int fd = vm->r->r[2].i;
+	if (would_block(fd, POLLIN)) return async_park(vm, fd, EPOLLIN);
+	return sys_read(vm);
+}
+
+/*
+	POLLOUT only promises room for PIPE_BUF bytes, so a longer write goes out in
+	pieces of that size, and the program waits again when the next piece doesn't
+	fit. To the program it's one write, like a blocking one.
+*/
+static const char *sys_write_async(evm_vm *vm)
+{
+	async_task *t = vm->user;
+	int fd = vm->r->r[2].i, len = vm->r->r[4].i;
+	char *buf = sys_buffer(vm, vm->r->r[3].i, len);
+	if (!buf) return sys_return(vm, -EFAULT);
+
+	fflush(stdout); // keep the order with put and fput
+	int err = 0;
+	while (t->written < len) {
+		if (would_block(fd, POLLOUT)) return async_park(vm, fd, EPOLLOUT);
+		int n = len - t->written < PIPE_BUF ? len - t->written : PIPE_BUF;
+		ssize_t k = write(fd, buf + t->written, n);
+		if (k < 0 && errno == EINTR) continue;
+		if (k < 0) err = errno;
+		if (k <= 0) break;
+		t->written += (int)k;
+	}
+	long long ret = t->written ? t->written : -err;
+	t->written = 0;
+	return sys_return(vm, ret);
+}
+
+/*
+	A thread that is still running is waited for like a file descriptor: an
+	eventfd that the thread writes to when it finishes.
+*/
+static const char *sys_join_async(evm_vm *vm)
+{
+	hart_table *tab = heap_of(vm)->threads;
+	int id = vm->r->r[2].i;
+	if (!tab || id < 1 || id > MAX_HARTS) return sys_join(vm);
+
+	hart *h = &tab->harts[id-1];
+	pthread_mutex_lock(&tab->lock);
+	int running = h->used == 1 && !h->finished;
+	if (running && h->notify < 0) h->notify = eventfd(0, EFD_CLOEXEC);
+	int fd = h->notify;
+	pthread_mutex_unlock(&tab->lock);
+	if (running && fd >= 0) return async_park(vm, fd, EPOLLIN);
+	return sys_join(vm);
+}
+
+// completes the syscall that the program is parked in
+static void async_complete(async_task *t)
+{
+	t->vm.r = &t->r;
+	t->vm.wait = 0;
+	t->errmsg = t->vm.natives[t->r.r[1].i](&t->vm);
+}
+
+static const evm_native async_natives[] = {
+	[SYS_READ]  = sys_read_async,
+	[SYS_WRITE] = sys_write_async,
+	[SYS_OPEN]  = sys_open,
+	[SYS_CLOSE] = sys_close,
+	[SYS_CLOCK] = sys_clock,
+	[SYS_SPAWN] = sys_spawn,
+	[SYS_JOIN]  = sys_join_async,
+	[SYS_SNAPSHOT] = sys_snapshot,
+	[SYS_ALLOC]  = sys_alloc,
+	[SYS_FREE]   = sys_free,
+	[SYS_RESIZE] = sys_resize,
+};
+
+const char *run_async(char **files)
+{
+	int ntasks = 0;
+	while (files[ntasks]) ntasks++;
+
+	async_task *tasks = calloc(ntasks, sizeof(*tasks));
+	if (!tasks) die(0, "out of memory");
+
+	const char *err = 0;
+	for (int i = 0; i < ntasks && !err; i++) {
+		async_task *t = tasks + i;
+		t->fname = files[i];
+		t->buf = slurp(files[i], &t->size);
+		t->waitfd = -1;
+		// room for a heap after the image
+		if (t->buf && t->size < MAX_IMAGE_BYTES) {
+			unsigned char *grown = realloc(t->buf, MAX_IMAGE_BYTES);
+			if (grown) t->buf = grown, t->size = MAX_IMAGE_BYTES;
+		}
+		t->vm = (evm_vm){.user = t, .natives = async_natives, .nnatives = COUNT_ARRAY(async_natives)};
+		if (!t->buf) err = "couldn't open specified file";
+		else err = validate_evm_mem(t->size, (evm_mem*)t->buf);
 	}
-	printf("--- CODE SECTION ---------------------------------\n");
-	int i = img->len_data;
 
-	while (i < img->len_code+img->len_data)
-	{
-		char indicator = i == ip ? '>' : ' ';
+	int ep = err ? -1 : epoll_create1(EPOLL_CLOEXEC);
+	if (!err && ep < 0) err = "can't create epoll instance";
 
-		int op = mem[i].i;
-		if (op < OP_STOP || op >= OP_INVAL) 
-			die(0, "Illegal instruction 0x%0.8x", op);
-		assert(evm_ops[op].opcode == op);
+	int running = ntasks, waiting = 0, failed = 0;
+	while (!err && running) {
+		for (int i = 0; i < ntasks; i++) {
+			async_task *t = tasks + i;
+			if (t->done || t->waitfd >= 0) continue;
+
+			evm_status s;
+			if (t->errmsg) {
+				s = (evm_status){.errmsg = t->errmsg, .r = t->r, .nregs = evm_numregs((evm_mem*)t->buf)};
+			} else {
+				evm_regs *start = t->started ? &t->r : evm_snapshot_regs((int)t->size, (evm_mem*)t->buf);
+				s = evm_run((int)t->size, (evm_mem*)t->buf, &t->vm, start, 0);
+				t->started = 1;
+				t->r = s.r;
+			}
 
-		// print the address
-		printf("%.8x:   ", i);
+			if (s.wait) {
+				struct epoll_event ev = {.events = t->parkevents, .data.ptr = t};
+				t->waitfd = dup(t->parkfd);
+				if (t->waitfd < 0 || epoll_ctl(ep, EPOLL_CTL_ADD, t->waitfd, &ev)) {
+					// can't wait for it (e.g. a bad file descriptor): let the syscall fail
+					if (t->waitfd >= 0) close(t->waitfd);
+					t->waitfd = -1;
+					async_complete(t);
+					if (t->vm.wait) sys_return(&t->vm, -EAGAIN);
+					continue;
+				}
+				waiting++;
+				continue;
+			}
 
-		// print the actual memory in hex
-		printf("%.8x ", op);
-		if (evm_ops[op].nargs > 0) 
-			printf("%.8x ", mem[i+1].u);
-		else 
-			printf("         ");
+			t->done = 1;
+			running--;
+			t->errmsg = s.errmsg;
+			if (s.errmsg) {
+				fflush(stdout);
+				fprintf(stderr, "%s: ", t->fname);
+				report_error(s);
+				failed++;
+			}
+		}
 
-		if (evm_ops[op].nargs == 2) 
-			printf("%.8x %c%c", mem[i+2].u, indicator, indicator);
-		else 
-			printf("         %c%c", indicator, indicator);
+		if (waiting) {
+			// block only if every program is waiting
+			struct epoll_event events[64];
+			int n;
+			fflush(stdout);
+			do n = epoll_wait(ep, events, COUNT_ARRAY(events), waiting == running ? -1 : 0);
+			while (n < 0 && errno == EINTR);
+			if (n < 0) {
+				err = "epoll_wait failed";
+				break;
+			}
 
-		// print the disassembly 
-		printf("%s", evm_ops[op].str);
-		for(int k = strlen(evm_ops[op].str); k < 8; k++)
-			fputc(' ', stdout);
+			for (int k = 0; k < n; k++) {
+				// complete the syscall without blocking, then the program can run again
+				// (r1 still holds the syscall code)
+				async_task *t = events[k].data.ptr;
+				async_complete(t);
+				if (t->vm.wait) continue; // another program got there first, or more to write
 
-		if (evm_ops[op].nargs > 0) 
-		{
-			if (evm_ops[op].argtypes[0] == EVM_REG) {
-				if(mem[i+1].i == 0)
-					printf("sp");
-				else
-					printf("r%i", mem[i+1].i);
-			} else if (evm_ops[op].argtypes[0] == EVM_MEM) {
-				printf("%x", mem[i+1].u);
-			} else if (evm_ops[op].argtypes[0] == EVM_IMMI) {
-				printf("%i", mem[i+1].i);
-			} else if (evm_ops[op].argtypes[0] == EVM_IMMF) {
-				printf("%f", mem[i+1].f);
-			} else assert(0);
-
-			if (evm_ops[op].nargs > 1) 
-			{
-				printf(", ");
-				if (evm_ops[op].argtypes[1] == EVM_REG) {
-					if(mem[i+2].i == 0)
-						printf("sp");
-					else
-						printf("r%i", mem[i+2].i);
-				} else if (evm_ops[op].argtypes[1] == EVM_MEM) {
-					printf("%x", mem[i+2].u);
-				} else if (evm_ops[op].argtypes[1] == EVM_IMMI) {
-					printf("%i", mem[i+2].i);
-				} else if (evm_ops[op].argtypes[1] == EVM_IMMF) {
-					printf("%f", mem[i+2].f);
-				} else assert(0);
+				epoll_ctl(ep, EPOLL_CTL_DEL, t->waitfd, 0);
+				close(t->waitfd);
+				t->waitfd = -1;
+				waiting--;
 			}
 		}
+	}
 
-		printf("\n");
-		i += 1 + evm_ops[op].nargs;
+	if (ep >= 0) close(ep);
+	for (int i = 0; i < ntasks; i++) {
+		// only now, so that joining the threads that a program left running doesn't hold up the others
+		heap_release(&tasks[i].vm, tasks[i].errmsg != 0);
+		free(tasks[i].buf);
 	}
+	free(tasks);
+	if (!err && failed) err = "one or more programs failed";
+	return err;
+}
+
+#else
 
+const char *run_async(char **files)
+{
+	(void)files;
+	return "asynchronous I/O is only supported on Linux";
+}
+
+#endif
+
+/*
+	Execution server (-serve socket) and client (-client socket)
+
+	The server listens on a Unix domain socket and runs the jobs sent to it, so
+	that a job doesn't pay for starting evm, loading its image into a fresh
+	buffer and translating its code. Each worker thread accepts a connection,
+	reads one job from it, runs it in the worker's own buffer and closes the
+	connection. A client that sends nothing for SERVE_TIMEOUT seconds is
+	dropped, and a job whose client hangs up is stopped. The translations (see -C) of the most recently run images are
+	kept in memory.
+
+	Everything sent on a connection is a frame: a header, followed by len
+	bytes. A job is the image (or the path of an image file on the server's
+	machine), any number of input frames, and a run frame. The program's
+	standard input is the input sent (empty if none), and it can't use threads.
+	The server sends back the output of the program as stdout and stderr
+	frames, and then a status frame.
+*/
+
+#ifdef __linux__
+
+#define SERVE_MAGIC (((int)'E')<<16 | ((int)'V')<<8 | ((int)'S'))
+#define SERVE_TRANSLATIONS 32 // images whose translations are kept
+#define SERVE_FDS 16          // files that a job can have open
+#define SERVE_TIMEOUT 10      // seconds that the server waits for the next part of a request
+#define SERVE_SLICE (1<<22)   // instructions that a job runs between looks at its connection
+
+enum { SERVE_IMAGE = 1, SERVE_PATH, SERVE_INPUT, SERVE_RUN, SERVE_STDOUT, SERVE_STDERR, SERVE_STATUS };
+
+typedef struct {
+	int magic;
+	int kind;
+	int len; // bytes that follow
+} serve_frame;
+
+typedef struct {
+	evm_regs r;
+	int failed, stop, nregs;
+	long long retired, syscalls, out_bytes;
+	char errmsg[256];
+} serve_status;
+
+typedef struct {
+	int sock, kind;
+} serve_stream;
+
+typedef struct {
+	int in;              // the program's standard input
+	FILE *out, *err;
+	int fds[SERVE_FDS];  // the files that the program opened
+	int nfds;
+} serve_job;
+
+typedef struct {
+	unsigned long long key, used;
+	int len_code; // -1 if the image can't be translated
+	evm_word *code;
+} serve_translation;
+
+static serve_translation serve_cache[SERVE_TRANSLATIONS];
+static unsigned long long serve_clock;
+static pthread_mutex_t serve_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int send_all(int fd, const void *data, long long len)
+{
+	const char *p = data;
+	while (len > 0) {
+		ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return -1;
+		p += n;
+		len -= n;
+	}
 	return 0;
 }
 
-const char* interactive(int bufsz, unsigned char *buf)
+static int recv_all(int fd, void *data, long long len)
 {
-	evm_mem *memory = (void*)buf;
-	const char *err = validate_evm_mem(bufsz, memory);  
-	if(err) return err;
+	char *p = data;
+	while (len > 0) {
+		ssize_t n = recv(fd, p, len, 0);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
 
-	terminal_state(1);
+static int send_frame(int fd, int kind, const void *data, int len)
+{
+	serve_frame f = {.magic = SERVE_MAGIC, .kind = kind, .len = len};
+	if (send_all(fd, &f, ssizeof(f))) return -1;
+	return send_all(fd, data, len);
+}
 
-	char garbage[500] = {0};
+static ssize_t serve_stream_write(void *cookie, const char *data, size_t len)
+{
+	serve_stream *s = cookie;
+	return send_frame(s->sock, s->kind, data, (int)len) ? -1 : (ssize_t)len;
+}
 
-	int start_data = 0;
-	int end_data   = memory->len_data;
-	int start_code = end_data;
-	int end_code   = start_code + memory->len_code;
+static int serve_own_fd(serve_job *j, int fd)
+{
+	for (int i = 0; i < j->nfds; i++) 
+		if (j->fds[i] == fd) return i;
+	return -1;
+}
 
-	evm_regs state = {.ip = start_code, .sp = end_data-1};
-	evm_status stat = {0};
+static const char *serve_read(evm_vm *vm)
+{
+	serve_job *j = vm->user;
+	int fd = vm->r->r[2].i;
+	if (fd != 0 && serve_own_fd(j, fd) < 0) return sys_return(vm, -EBADF);
+	vm->r->r[2].i = fd ? fd : j->in;
+	const char *err = sys_read(vm);
+	vm->r->r[2].i = fd;
+	return err;
+}
+
+static const char *serve_write(evm_vm *vm)
+{
+	serve_job *j = vm->user;
+	int fd = vm->r->r[2].i, len = vm->r->r[4].i;
+	if (fd != 1 && fd != 2) return serve_own_fd(j, fd) < 0 ? sys_return(vm, -EBADF) : sys_write(vm);
+
+	char *buf = sys_buffer(vm, vm->r->r[3].i, len);
+	if (!buf) return sys_return(vm, -EFAULT);
+	if (fd == 2) fflush(j->out); // keep the order with put and fput
+	if (fwrite(buf, 1, len, fd == 1 ? j->out : j->err) != (size_t)len) return sys_return(vm, -EPIPE);
+	return sys_return(vm, len);
+}
+
+static const char *serve_open(evm_vm *vm)
+{
+	serve_job *j = vm->user;
+	const char *err = sys_open(vm);
+	int fd = vm->r->r[1].i;
+	if (err || fd < 0) return err;
+	if (j->nfds == SERVE_FDS) {
+		close(fd);
+		return sys_return(vm, -EMFILE);
+	}
+	j->fds[j->nfds++] = fd;
+	return 0;
+}
 
-	while(!stat.errmsg) {
-		// clear screen
-		printf("\x1b[2J");
-		err = disassemble(bufsz, buf, state.ip);	
+static const char *serve_close(evm_vm *vm)
+{
+	serve_job *j = vm->user;
+	int fd = vm->r->r[2].i;
+	if (fd >= 0 && fd <= 2) return sys_return(vm, 0);
+	int i = serve_own_fd(j, fd);
+	if (i < 0) return sys_return(vm, -EBADF);
+	j->fds[i] = j->fds[--j->nfds];
+	return sys_close(vm);
+}
 
-		printf("--- CPU STATE ------------------------------------\n");
-		printf("\tip  %.8x\n", state.ip);
-		printf("\tsp  %.8x\n", state.sp);
-		for(int i = 1; i < ssizeof(state.r)/ssizeof(state.r[0]); i++) 
-			printf("\tr%i  %.8x (%i) (%f)\n", i, state.r[i].u, state.r[i].i, state.r[i].f);
+static const evm_native serve_natives[] = {
+	[SYS_READ]  = serve_read,
+	[SYS_WRITE] = serve_write,
+	[SYS_OPEN]  = serve_open,
+	[SYS_CLOSE] = serve_close,
+	[SYS_CLOCK] = sys_clock,
+	[SYS_SNAPSHOT] = sys_snapshot,
+	[SYS_ALLOC]  = sys_alloc,
+	[SYS_FREE]   = sys_free,
+	[SYS_RESIZE] = sys_resize,
+};
 
-		if(stat.stop || err) break;
+// replace the code of the image with its translation, translating it if it was not seen recently
+static void serve_translate(evm_mem *img)
+{
+	unsigned long long key = image_key(img);
+	evm_word *code = img->mem + img->len_data;
 
-		fgets(garbage, ssizeof(garbage), stdin);
-		stat = evm_run(bufsz, memory, 0, &state, 1);
-		state = stat.r;
+	pthread_mutex_lock(&serve_lock);
+	serve_translation *t = 0, *oldest = &serve_cache[0];
+	for (int i = 0; i < SERVE_TRANSLATIONS; i++) {
+		if (serve_cache[i].code && serve_cache[i].key == key) t = &serve_cache[i];
+		if (serve_cache[i].used < oldest->used) oldest = &serve_cache[i];
 	}
-	terminal_state(0);
-	return err;
+	if (t) {
+		t->used = ++serve_clock;
+		if (t->len_code >= 0) {
+			memcpy(code, t->code, 4LL*t->len_code);
+			img->len_code = t->len_code;
+		}
+		pthread_mutex_unlock(&serve_lock);
+		return;
+	}
+	pthread_mutex_unlock(&serve_lock);
+
+	const char *err;
+	evm_mem *out = optimize_image(img, &err);
+	int len_code = out ? out->len_code : -1;
+	evm_word *copy = malloc(4LL*(len_code > 0 ? len_code : 1));
+	if (!copy) die(0, "out of memory");
+	if (out) {
+		memcpy(copy, out->mem + out->len_data, 4LL*len_code);
+		memcpy(code, copy, 4LL*len_code);
+		img->len_code = len_code;
+		free(out);
+	}
+
+	pthread_mutex_lock(&serve_lock);
+	free(oldest->code);
+	*oldest = (serve_translation){.key = key, .used = ++serve_clock, .len_code = len_code, .code = copy};
+	pthread_mutex_unlock(&serve_lock);
 }
 
+// read a job from the connection into buf
+static const char *serve_receive(int sock, serve_job *j, unsigned char *buf, int bufsz)
+{
+	long long size = 0;
+	for (;;) {
+		serve_frame f;
+		if (recv_all(sock, &f, ssizeof(f))) return errno == EAGAIN || errno == EWOULDBLOCK ? "timed out waiting for request" : "bad request";
+		if (f.magic != SERVE_MAGIC || f.len < 0) return "bad request";
 
+		if (f.kind == SERVE_RUN) {
+			break;
+		} else if (f.kind == SERVE_IMAGE) {
+			if (f.len > bufsz) return "image too large";
+			if (recv_all(sock, buf, f.len)) return "bad request";
+			size = f.len;
+		} else if (f.kind == SERVE_PATH) {
+			char path[4096];
+			if (f.len >= ssizeof(path)) return "path too long";
+			if (recv_all(sock, path, f.len)) return "bad request";
+			path[f.len] = 0;
 
-const char* ingest_file(int bufsz, unsigned char *buf, char *fname)
+			int fd = open(path, O_RDONLY | O_CLOEXEC);
+			struct stat st;
+			if (fd < 0 || fstat(fd, &st)) {
+				if (fd >= 0) close(fd);
+				return "couldn't open specified file";
+			}
+			if (st.st_size > bufsz) {
+				close(fd);
+				return "couldn't read specified file, buffer too small";
+			}
+			size = 0;
+			while (size < st.st_size) {
+				ssize_t n = read(fd, buf + size, st.st_size - size);
+				if (n < 0 && errno == EINTR) continue;
+				if (n <= 0) break;
+				size += n;
+			}
+			close(fd);
+			if (size != st.st_size) return "couldn't read specified file";
+		} else if (f.kind == SERVE_INPUT) {
+			if (j->in < 0) j->in = memfd_create("evm-input", MFD_CLOEXEC);
+			if (j->in < 0) return "can't keep input in memory";
+			char chunk[65536];
+			for (int left = f.len; left > 0; ) {
+				int n = left < ssizeof(chunk) ? left : ssizeof(chunk);
+				if (recv_all(sock, chunk, n) || write(j->in, chunk, n) != n) return "can't receive input";
+				left -= n;
+			}
+		} else {
+			return "bad request";
+		}
+	}
+
+	if (j->in < 0) j->in = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	else lseek(j->in, 0, SEEK_SET);
+	if (!size) return "no image in request";
+	return validate_evm_mem((int)size, (evm_mem*)buf);
+}
+
+static void serve_connection(int sock, unsigned char *buf, int bufsz)
 {
-	FILE *f = fopen(fname, "rb");
-	if(!f) return "couldn't open specified file";
+	serve_job j = {.in = -1};
+	serve_status st = {0};
+	evm_mem *img = (evm_mem*)buf;
 
-	fseek(f, 0, SEEK_END);
-	long sz = ftell(f);
-	fseek(f, 0, SEEK_SET);
+	const char *err = serve_receive(sock, &j, buf, bufsz);
+	if (err) {
+		st.failed = 1;
+		snprintf(st.errmsg, sizeof(st.errmsg), "%s", err);
+	} else {
+		serve_stream out = {sock, SERVE_STDOUT}, errs = {sock, SERVE_STDERR};
+		cookie_io_functions_t io = {.write = serve_stream_write};
+		j.out = fopencookie(&out, "w", io);
+		j.err = fopencookie(&errs, "w", io);
+		if (!j.out || !j.err) die(0, "out of memory");
+		setvbuf(j.out, 0, _IOFBF, 1<<16);
 
-	if(sz > bufsz) 
-		return "couldn't read specified file, buffer too small";
+		if (!(img->version & EVM_SNAPSHOT)) serve_translate(img);
+		evm_vm vm = {.user = &j, .natives = serve_natives, .nnatives = COUNT_ARRAY(serve_natives), .out = j.out};
 
-	if(sz != fread(buf, 1, bufsz, f)) 
-		return "error while reading specified file";
+		// in slices, so that the job can be stopped when its client hangs up
+		evm_hooks hooks = {.limit = SERVE_SLICE};
+		evm_regs r, *from = evm_snapshot_regs(bufsz, img);
+		evm_status s;
+		for (;;) {
+			s = evm_run_ex(bufsz, img, &vm, from, EVM_DEFAULT_FLAGS | EVM_HOOKED, &hooks);
+			st.retired += s.retired;
+			st.syscalls += s.syscalls;
+			st.out_bytes += s.out_bytes;
+			if (s.errmsg || s.stop || s.retired < SERVE_SLICE) break;
+			struct pollfd p = {.fd = sock};
+			if (poll(&p, 1, 0) > 0 && (p.revents & (POLLHUP | POLLERR))) {
+				s.errmsg = "stopped: the client hung up";
+				break;
+			}
+			r = s.r;
+			from = &r;
+		}
+		heap_release(&vm, s.errmsg != 0);
+		fclose(j.out);
+		fclose(j.err);
+
+		st.r = s.r;
+		st.failed = !!s.errmsg;
+		st.stop = s.stop;
+		st.nregs = s.nregs;
+		if (s.errmsg) snprintf(st.errmsg, sizeof(st.errmsg), "%s", s.errmsg);
+	}
+	send_frame(sock, SERVE_STATUS, &st, ssizeof(st));
+
+	for (int i = 0; i < j.nfds; i++) close(j.fds[i]);
+	if (j.in >= 0) close(j.in);
+}
+
+static void *serve_worker(void *arg)
+{
+	int listener = *(int*)arg;
+	unsigned char *buf = malloc(MAX_IMAGE_BYTES);
+	if (!buf) die(0, "out of memory");
+	for (;;) {
+		int sock = accept4(listener, 0, 0, SOCK_CLOEXEC);
+		if (sock < 0) {
+			if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE) continue;
+			break;
+		}
+		struct timeval timeout = {.tv_sec = SERVE_TIMEOUT};
+		setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		serve_connection(sock, buf, MAX_IMAGE_BYTES);
+		close(sock);
+	}
+	free(buf);
+	return 0;
+}
+
+static int serve_address(struct sockaddr_un *a, const char *path)
+{
+	*a = (struct sockaddr_un){.sun_family = AF_UNIX};
+	if (strlen(path) >= sizeof(a->sun_path)) return -1;
+	strcpy(a->sun_path, path);
+	return 0;
+}
+
+const char *serve(const char *path)
+{
+	struct sockaddr_un a;
+	if (serve_address(&a, path)) return "socket path too long";
+	int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listener < 0) return "can't create socket";
+	unlink(path);
+	if (bind(listener, (struct sockaddr*)&a, sizeof(a)) || listen(listener, 128)) 
+		return "can't listen on socket";
+
+	long nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nworkers < 1) nworkers = 1;
+	pthread_t *workers = calloc(nworkers, sizeof(*workers));
+	if (!workers) die(0, "out of memory");
+	for (long i = 0; i < nworkers; i++) 
+		if (pthread_create(&workers[i], 0, serve_worker, &listener)) return "can't start worker threads";
+	fprintf(stderr, "serving on %s with %ld workers\n", path, nworkers);
+	for (long i = 0; i < nworkers; i++) 
+		pthread_join(workers[i], 0);
+	free(workers);
+	close(listener);
+	unlink(path);
+	return 0;
+}
+
+// run an image on the server, with the standard input (unless it's a terminal)
+const char *serve_client(const char *path, const char *fname)
+{
+	struct sockaddr_un a;
+	if (serve_address(&a, path)) return "socket path too long";
+	long size = 0;
+	unsigned char *image = slurp(fname, &size);
+	if (!image) return "couldn't open specified file";
+	if (size > MAX_IMAGE_BYTES) return "couldn't read specified file, buffer too small";
+
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0 || connect(sock, (struct sockaddr*)&a, sizeof(a))) return "can't connect to server";
+
+	int failed = send_frame(sock, SERVE_IMAGE, image, (int)size);
+	free(image);
+	if (!isatty(0)) {
+		char chunk[65536];
+		ssize_t n;
+		while (!failed && (n = read(0, chunk, sizeof(chunk))) > 0) 
+			failed = send_frame(sock, SERVE_INPUT, chunk, (int)n);
+	}
+	if (failed || send_frame(sock, SERVE_RUN, 0, 0)) return "can't send job to server";
+
+	for (;;) {
+		serve_frame f;
+		if (recv_all(sock, &f, ssizeof(f)) || f.magic != SERVE_MAGIC || f.len < 0) break;
+		if (f.kind == SERVE_STATUS) {
+			serve_status st;
+			if (f.len != ssizeof(st) || recv_all(sock, &st, ssizeof(st))) break;
+			close(sock);
+			if (!st.failed) return 0;
+			fflush(stdout);
+			report_error((evm_status){.errmsg = st.errmsg, .r = st.r, .nregs = st.nregs});
+			exit(EXIT_FAILURE);
+		}
+		// output
+		char chunk[65536];
+		for (int left = f.len; left > 0; ) {
+			int n = left < ssizeof(chunk) ? left : ssizeof(chunk);
+			if (recv_all(sock, chunk, n)) break;
+			fwrite(chunk, 1, n, f.kind == SERVE_STDERR ? stderr : stdout);
+			left -= n;
+		}
+		if (f.kind == SERVE_STDERR) fflush(stderr);
+	}
+	close(sock);
+	return "connection to server lost";
+}
+
+#else
+
+const char *serve(const char *path)
+{
+	(void)path;
+	return "the execution server is only supported on Linux";
+}
+
+const char *serve_client(const char *path, const char *fname)
+{
+	(void)path; (void)fname;
+	return "the execution server is only supported on Linux";
+}
 
+#endif
+
+/*
+	Benchmarks (-bench reps)
+
+	Assembles each source file given on the command line and reports the
+	assembler throughput, the startup latency of the assembled program (loading
+	the bytecode file, validating it and executing the first instruction), and
+	the instruction throughput of every execution engine. Each measurement is
+	repeated after a warm-up run and reported as mean, standard deviation and
+	minimum. Program output is discarded while the benchmarks run.
+*/
+
+typedef struct {
+	double sum, sumsq, min, max;
+	int n;
+} bench_stat;
+
+static void bench_add(bench_stat *st, double x)
+{
+	if (!st->n || x < st->min) st->min = x;
+	if (!st->n || x > st->max) st->max = x;
+	st->sum += x;
+	st->sumsq += x*x;
+	st->n++;
+}
+
+// print mean, standard deviation and the best result (lowest, for times)
+static void bench_print(const char *what, const char *unit, bench_stat st, int is_time)
+{
+	double mean = st.sum / st.n;
+	double var = st.n > 1 ? (st.sumsq - st.n*mean*mean) / (st.n-1) : 0;
+	double sd = var > 0 ? var : 1;
+	for (int i = 0; i < 64 && var > 0; i++) sd = (sd + var/sd) / 2; // sqrt without libm
+	if (var <= 0) sd = 0;
+
+	printf("  %-12s %12.3f %s  +- %-10.3f best %.3f\n", what, mean, unit, sd, is_time ? st.min : st.max);
+}
+
+// a large synthetic source file, for measuring the assembler
+static char *bench_source(long long *len)
+{
+	enum { NDATA = 2000, NBLOCKS = 4000, BLOCKLEN = 48 };
+	long long cap = 64LL*(NDATA + NBLOCKS*BLOCKLEN) + 64, n = 0;
+	char *src = malloc(cap);
+	if (!src) die(0, "out of memory");
+
+	n += sprintf(src+n, "# generated benchmark source\n");
+	for (int i = 0; i < NDATA; i++) 
+		n += sprintf(src+n, "v%i:\t%i\n", i, i);
+	n += sprintf(src+n, "stack: zeros 16\n\nstart\n");
+	for (int b = 0; b < NBLOCKS; b++) {
+		n += sprintf(src+n, "b%i:\tld\tr1, v%i\n", b, b % NDATA);
+		for (int i = 1; i < BLOCKLEN-1; i++) {
+			switch (i % 4) {
+			case 0: n += sprintf(src+n, "\tadd\tr2, r1   # accumulate\n"); break;
+			case 1: n += sprintf(src+n, "\tfset\tr3, %i.25\n", i); break;
+			case 2: n += sprintf(src+n, "\tst\tv%i, r2\n", (b+i) % NDATA); break;
+			case 3: n += sprintf(src+n, "\tjz\tr4, b%i\n", (b+1) % NBLOCKS); break;
+			}
+		}
+		n += sprintf(src+n, "\tlda\tr4, v%i\n", b % NDATA);
+	}
+	n += sprintf(src+n, "\tstop\n");
+	assert(n < cap);
+	*len = n;
+	return src;
+}
+
+static void bench_assembler(int reps, char *src, long long len)
+{
+	bench_stat st = {0};
+	for (int r = -1; r < reps; r++) {
+		double t = seconds(CLOCK_MONOTONIC);
+		parse_ctx p = {.bufsz = (int)len + 1, .buf = src};
+		free(assemble_image(&p));
+		free_parse_ctx(&p);
+		t = seconds(CLOCK_MONOTONIC) - t;
+		if (r >= 0) bench_add(&st, len / t * 1e-6);
+	}
+	bench_print("assembler", "MB/s", st, 0);
+}
+
+static const char *bench_startup(int reps, evm_mem *img, long long imgsz, unsigned char *buf, int bufsz)
+{
+	char fname[] = "/tmp/evm-bench-XXXXXX";
+	int fd = mkstemp(fname);
+	if (fd < 0) return "can't create temporary file";
+	FILE *f = fdopen(fd, "wb");
+	fwrite(img, 1, imgsz, f);
 	fclose(f);
+
+	bench_stat st = {0};
+	const char *err = 0;
+	for (int r = -1; r < reps && !err; r++) {
+		double t = seconds(CLOCK_MONOTONIC);
+		err = ingest_file(bufsz, buf, fname);
+		if (!err) err = validate_evm_mem(bufsz, (evm_mem*)buf);
+		evm_vm vm = host_vm(0);
+		if (!err) evm_run(bufsz, (evm_mem*)buf, &vm, 0, 1);
+		t = seconds(CLOCK_MONOTONIC) - t;
+		if (r >= 0) bench_add(&st, t * 1e6);
+	}
+	unlink(fname);
+	if (!err) bench_print("startup", "us  ", st, 1);
+	return err;
+}
+
+static const char *bench_engine(int reps, const char *name, evm_mem *img, long long imgsz, unsigned char *buf, int bufsz, int flags)
+{
+	bench_stat st = {0};
+	for (int r = -1; r < reps; r++) {
+		memcpy(buf, img, imgsz);
+		int saved = quiet_stdout(-1);
+		double t = seconds(CLOCK_MONOTONIC);
+		evm_vm vm = host_vm(0);
+		evm_status s = evm_run_ex(bufsz, (evm_mem*)buf, &vm, 0, flags, 0);
+		heap_release(&vm, s.errmsg != 0);
+		t = seconds(CLOCK_MONOTONIC) - t;
+		quiet_stdout(saved);
+		if (s.errmsg) return s.errmsg;
+		if (r >= 0) bench_add(&st, s.retired / t * 1e-6);
+	}
+	bench_print(name, "Mi/s", st, 0);
+	return 0;
+}
+
+// all lanes of a batch run the same program on the same data
+static const char *bench_batch(int reps, evm_mem *img, long long imgsz)
+{
+	enum { LANES = 64 };
+	int len_data = img->len_data;
+	evm_word *data = malloc(sizeof(evm_word) * LANES * (len_data ? len_data : 1));
+	evm_status status[LANES];
+	if (!data) die(0, "out of memory");
+
+	bench_stat st = {0};
+	const char *err = 0;
+	for (int r = -1; r < reps && !err; r++) {
+		for (int i = 0; i < len_data; i++) 
+			for (int l = 0; l < LANES; l++) 
+				data[i*LANES + l] = img->mem[i];
+
+		evm_batch b = {.lanes = LANES, .data = data, .status = status};
+		int saved = quiet_stdout(-1);
+		double t = seconds(CLOCK_MONOTONIC);
+		err = evm_run_batch((int)imgsz, img, &b);
+		t = seconds(CLOCK_MONOTONIC) - t;
+		quiet_stdout(saved);
+
+		long long retired = 0;
+		for (int l = 0; l < LANES && !err; l++) {
+			err = status[l].errmsg;
+			retired += status[l].retired;
+		}
+		if (r >= 0 && !err) bench_add(&st, retired / t * 1e-6);
+	}
+	free(data);
+	if (!err) bench_print("batch", "Mi/s", st, 0);
+	else printf("  %-12s (%s)\n", "batch", err);
 	return 0;
 }
 
+const char *bench(int reps, char **files)
+{
+	int bufsz = MAX_IMAGE_BYTES;
+	unsigned char *buf = calloc(1, bufsz);
+	if (!buf) die(0, "out of memory");
+
+	long long len = 0;
+	char *src = bench_source(&len);
+	printf("(generated source, %lli bytes)\n", len);
+	bench_assembler(reps, src, len);
+	free(src);
+
+	const char *err = 0;
+	for (; *files && !err; files++) {
+		long size = 0;
+		unsigned char *text = slurp(*files, &size);
+		if (!text) { 
+			err = "couldn't read specified file";
+			break;
+		}
+		src = realloc(text, size+1);
+		src[size] = 0;
+
+		parse_ctx p = {.bufsz = (int)size + 1, .buf = src};
+		evm_mem *img = assemble_image(&p);
+		long long imgsz = ssizeof(*img) + 4LL*p.mempos;
+		free_parse_ctx(&p);
+
+		printf("%s (%lli bytes, %i words)\n", *files, (long long)size, p.mempos);
+		bench_assembler(reps, src, size);
+		err = bench_startup(reps, img, imgsz, buf, bufsz);
+		if (!err) err = bench_engine(reps, "checked", img, imgsz, buf, bufsz, 0);
+		if (!err) err = bench_engine(reps, "unchecked", img, imgsz, buf, bufsz, EVM_UNCHECKED);
+		if (!err) err = bench_batch(reps, img, imgsz);
+
+		evm_mem *opt = err ? 0 : optimize_image(img, &err);
+		if (opt) {
+			long long optsz = ssizeof(*opt) + 4LL*(opt->len_data + opt->len_code);
+			err = bench_engine(reps, "optimized", opt, optsz, buf, bufsz, EVM_DEFAULT_FLAGS);
+			free(opt);
+		}
+		free(img);
+		free(src);
+	}
+	free(buf);
+	return err;
+}
+
 int main (int argc, char **argv)
 {
-	enum { RUN, ASSEMBLE, DISASSEMBLE, INTERACTIVE } mode = RUN;
+	enum { RUN, ASSEMBLE, OBJECT, LINK, DISASSEMBLE, OPTIMIZE, PROFILE, SAMPLE, REPLAY, MEMPROFILE, PERF, INTERACTIVE, BENCH, ASYNC, BATCH, CLONE } mode = RUN;
+	int use_cache = 0;
+	const char *trace_file = 0;
+	const char *batch_file = 0;
+	const char *snapshot_file = 0;
+	const char *server = 0;
+	const char *debug_file = 0;
+	int bench_reps = 0, clones = 0;
+	run_metrics metrics = {0};
 
 	argv++;
 	for(; *argv; argv++) {
 		if (!strcmp(*argv, "-a")) {
 			mode = ASSEMBLE;
+		} else if (!strcmp(*argv, "-c")) {
+			mode = OBJECT;
+		} else if (!strcmp(*argv, "-l")) {
+			mode = LINK;
 		} else if (!strcmp(*argv, "-d")) {
 			mode = DISASSEMBLE;
+		} else if (!strcmp(*argv, "-O")) {
+			mode = OPTIMIZE;
+		} else if (!strcmp(*argv, "-C")) {
+			use_cache = 1;
+		} else if (!strcmp(*argv, "-p")) {
+			mode = PROFILE;
+		} else if (!strcmp(*argv, "-s")) {
+			mode = SAMPLE;
+		} else if (!strcmp(*argv, "-t") && argv[1]) {
+			trace_file = *++argv;
+		} else if (!strcmp(*argv, "-r") && argv[1]) {
+			mode = REPLAY;
+			trace_file = *++argv;
+		} else if (!strcmp(*argv, "-m")) {
+			mode = MEMPROFILE;
+		} else if (!strcmp(*argv, "-perf")) {
+			mode = PERF;
+		} else if (!strcmp(*argv, "-metrics") && argv[1]) {
+			metrics_open(&metrics, *++argv);
 		} else if (!strcmp(*argv, "-i")) {
 			mode = INTERACTIVE;
+		} else if (!strcmp(*argv, "-bench") && argv[1]) {
+			mode = BENCH;
+			bench_reps = atoi(*++argv);
+			if (bench_reps < 1) bench_reps = 1;
+		} else if (!strcmp(*argv, "-w") && argv[1]) {
+			if (nwatches == MAX_WATCHES) die(0, "too many watchpoints");
+			watches[nwatches++].spec = *++argv;
+		} else if (!strcmp(*argv, "-wstop")) {
+			watch_stop = 1;
+		} else if (!strcmp(*argv, "-g") && argv[1]) {
+			debug_file = *++argv;
+		} else if (!strcmp(*argv, "-S") && argv[1]) {
+			snapshot_file = *++argv;
+		} else if (!strcmp(*argv, "-clone") && argv[1]) {
+			mode = CLONE;
+			clones = atoi(*++argv);
+		} else if (!strcmp(*argv, "-batch") && argv[1]) {
+			mode = BATCH;
+			batch_file = *++argv;
+		} else if (!strcmp(*argv, "-serve") && argv[1]) {
+			const char *err = serve(argv[1]);
+			if(err) {
+				fprintf(stderr, "%s\n", err);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		} else if (!strcmp(*argv, "-client") && argv[1]) {
+			server = *++argv;
+		} else if (server) {
+			const char *err = serve_client(server, *argv);
+			if(err) {
+				fprintf(stderr, "%s\n", err);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		} else if (!strcmp(*argv, "-async")) {
+			mode = ASYNC;
+		} else if (mode == ASYNC) {
+			const char *err = run_async(argv);
+			if(err) {
+				fprintf(stderr, "%s\n", err);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		} else if (mode == BENCH) {
+			const char *err = bench(bench_reps, argv);
+			if(err) {
+				fprintf(stderr, "%s\n", err);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		} else if (mode == LINK) {
+			const char *err = link_objects(argv);
+			if(err) {
+				fprintf(stderr, "%s\n", err);
+				exit(EXIT_FAILURE);
+			}
+			break;
 		} else {
-			static unsigned char buf[4*1<<20] = {0};
+			static unsigned char buf[MAX_IMAGE_BYTES] = {0};
 			const char *err = ingest_file((int)sizeof(buf), buf, *argv);
+			if (!err && debug_file && mode != ASSEMBLE && mode != OBJECT) {
+				// -C replaces the code, so the addresses in the debug info wouldn't match it
+				if (use_cache && (mode == RUN || mode == PROFILE || mode == SAMPLE || mode == MEMPROFILE || mode == PERF)) 
+					err = "debug info (-g) doesn't match translated code (-C)";
+				if (!err) err = validate_evm_mem((int)sizeof(buf), (evm_mem*)buf);
+				if (!err) err = load_debug_info(debug_file, (evm_mem*)buf);
+			}
 
 			if(!err) switch(mode) {
 			case ASSEMBLE:
-				err = assemble((int)sizeof(buf), (char*)buf);
+				err = assemble((int)sizeof(buf), (char*)buf, 0, debug_file, *argv);
+				break;
+			case OBJECT:
+				err = assemble((int)sizeof(buf), (char*)buf, 1, debug_file, *argv);
 				break;
 			case DISASSEMBLE:
 				err = disassemble((int)sizeof(buf), buf, 0);
 				break;
 			case RUN: {
-					evm_status s = evm_run((int)sizeof(buf), (evm_mem*)buf, 0, 0, 0);
+					if (use_cache && (err = load_translated((int)sizeof(buf), buf))) break;
+					if (snapshot_file) {
+						err = take_snapshot((int)sizeof(buf), buf, snapshot_file);
+						break;
+					}
+					if (trace_file) {
+						err = trace((int)sizeof(buf), buf, trace_file);
+						break;
+					}
+					if (nwatches) {
+						err = watch((int)sizeof(buf), buf);
+						break;
+					}
+					double wall = seconds(CLOCK_MONOTONIC), cpu = seconds(CLOCK_PROCESS_CPUTIME_ID);
+					evm_vm vm = host_vm(0);
+					evm_regs *start = evm_snapshot_regs((int)sizeof(buf), (evm_mem*)buf);
+					evm_status s = evm_run((int)sizeof(buf), (evm_mem*)buf, &vm, start, 0);
+					if (s.errmsg) {
+						// before the threads that it left running stop
+						fflush(stdout);
+						report_error(s);
+					}
+					heap_release(&vm, s.errmsg != 0);
+					wall = seconds(CLOCK_MONOTONIC) - wall;
+					cpu = seconds(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+
+					metrics_record(&metrics, *argv, s, wall, cpu);
 					if (s.errmsg) {
-						fprintf(stderr, "%s\n", s.errmsg);
-						fprintf(stderr, "\tip  %i\n", s.r.ip);
-						fprintf(stderr, "\tsp  %i\n", s.r.sp);
-						for(int i = 1; i < ssizeof(s.r.r)/ssizeof(s.r.r[0]); i++) 
-							fprintf(stderr, "\tr%i  %i (%x) (%f)\n", i, s.r.r[i].i, s.r.r[i].u, s.r.r[i].f);
+						metrics_close(&metrics);
 						exit(EXIT_FAILURE);
 					}
-					exit(EXIT_SUCCESS);
+					continue; // run the next image, if any
 				}
+			case OPTIMIZE:
+				err = optimize((int)sizeof(buf), buf);
+				break;
+			case PROFILE:
+				if (use_cache && (err = load_translated((int)sizeof(buf), buf))) break;
+				err = profile((int)sizeof(buf), buf);
+				break;
+			case SAMPLE:
+				if (use_cache && (err = load_translated((int)sizeof(buf), buf))) break;
+				err = sample((int)sizeof(buf), buf);
+				break;
+			case REPLAY:
+				err = replay((int)sizeof(buf), buf, trace_file);
+				break;
+			case MEMPROFILE:
+				if (use_cache && (err = load_translated((int)sizeof(buf), buf))) break;
+				err = memprofile((int)sizeof(buf), buf);
+				break;
+			case PERF:
+				if (use_cache && (err = load_translated((int)sizeof(buf), buf))) break;
+				err = perf((int)sizeof(buf), buf);
+				break;
 			case INTERACTIVE:
 				err = interactive((int)sizeof(buf), buf);
 				break;
+			case BATCH:
+				err = batch((int)sizeof(buf), buf, batch_file);
+				break;
+			case CLONE:
+				err = run_clones(clones, *argv, &metrics);
+				break;
 			default:
 				assert(0);
 				break;
@@ -871,11 +5790,13 @@ int main (int argc, char **argv)
 
 			if(err) {
 				fprintf(stderr, "%s\n", err);
+				metrics_close(&metrics);
 				exit(EXIT_FAILURE);
 			}
 
 			break;
 		}
 	}
+	metrics_close(&metrics);
 	return 0;
 }